@@ -0,0 +1,432 @@
+#include "s3m.h"
+#include "mod.h"
+#include "s3mmix.h"
+#include "s3mthread.h"
+#include "synth.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define SAMPLE_RATE 48000
+#define BENCH_FRAMES 1024
+#define DEFAULT_SECONDS 20
+#define SAMPLE_LENGTH 8192
+#define MIN_CPU_SECONDS 0.25 /* Repeat short benchmarks at least this long */
+
+static const char* interpolation_names[] = {
+    "nearest",
+    "linear",
+    "cubic",
+    "sinc"
+};
+
+/* Modules generated when no files are given */
+static const struct SynthModule synth_suite[] = {
+    { "sparse-8ch", 0, 8, 8, 15, 0, 0, 0 },
+    { "dense-16ch", 0, 16, 8, 60, 0, 0, 0 },
+    { "effects-16ch", 0, 16, 8, 60, 1, 0, 0 },
+    { "full-32ch", 0, 32, 8, 90, 1, 0, 0 },
+    { "mod-4ch", 1, 4, 8, 50, 0, 0, 0 },
+    { "mod-8ch", 1, 8, 8, 50, 1, 0, 0 }
+};
+
+struct BenchSong {
+    const char* name;
+    const char* path;
+    int is_mod;
+    struct S3MFile s3m;
+    struct Mod mod;
+};
+
+/* One result per line: benchmark, subject, metric, value, tab separated */
+static void report(const char* benchmark, const char* subject, const char* metric, double value)
+{
+    printf("%s\t%s\t%s\t%.3f\n", benchmark, subject, metric, value);
+}
+
+static double cpu_seconds(clock_t start)
+{
+    return (double)(clock() - start) / CLOCKS_PER_SEC;
+}
+
+/* A looping sine with a little noise so every fetch does real work */
+static void make_sample(struct Sample* sample, int bits)
+{
+    int frame_size = bits / 8;
+    char* data = calloc(SAMPLE_LENGTH + 2 * S3M_SAMPLE_PAD, frame_size);
+    int i;
+
+    sample->sampledata = data + S3M_SAMPLE_PAD * frame_size;
+    sample->bits = bits;
+    sample->length = SAMPLE_LENGTH;
+    sample->loop_begin = 0;
+    sample->loop_end = SAMPLE_LENGTH;
+    sample->c2_speed = 8363;
+    sample->volume = 64;
+    for (i = 0; i < SAMPLE_LENGTH + S3M_SAMPLE_PAD; i++) {
+        double v = 0.5 * sin(2 * 3.14159265 * (i % SAMPLE_LENGTH) * 32 / SAMPLE_LENGTH)
+            + 0.1 * ((rand() % 2001) / 1000.0 - 1.0);
+        if (bits == 16)
+            ((short*)sample->sampledata)[i] = (short)(v * 32767);
+        else
+            ((signed char*)sample->sampledata)[i] = (signed char)(v * 127);
+    }
+}
+
+/*
+ * Mixes the given number of voices, each at a different pitch, through
+ * s3m_accumulate_sample_stream and reports the cost per voice per frame.
+ */
+static void bench_mixer(struct S3MPlayerContext* ctx, struct Sample* sample, enum S3MInterpolation mode, int voices)
+{
+    float* buffer = malloc(sizeof(float) * BENCH_FRAMES * 2);
+    long chunks = (long)DEFAULT_SECONDS * SAMPLE_RATE / BENCH_FRAMES;
+    double seconds;
+    char subject[64];
+    clock_t start;
+    long n;
+    int v;
+
+    ctx->interpolation = mode;
+    for (v = 0; v < voices; v++) {
+        ctx->channel[v].sample = sample;
+        ctx->channel[v].period = 1712 - v * 53; /* C-4 and upwards */
+        ctx->channel[v].volume = 48;
+        ctx->channel[v].panning = v & 15;
+        ctx->channel[v].note_on = 1;
+    }
+    ctx->enabled_channels = (1UL << voices) - 1;
+    s3m_update_voices(ctx);
+
+    start = clock();
+    for (n = 0; n < chunks; n++) {
+        memset(buffer, 0, sizeof(float) * BENCH_FRAMES * 2);
+        for (v = 0; v < voices; v++)
+            s3m_accumulate_sample_stream(buffer, BENCH_FRAMES, &ctx->sample_stream[v], ctx);
+    }
+    seconds = cpu_seconds(start);
+
+    sprintf(subject, "%s-%dbit-%dv", interpolation_names[mode], sample->bits, voices);
+    report("mixer", subject, "ns_per_frame_voice", seconds * 1e9 / ((double)chunks * BENCH_FRAMES * voices));
+    report("mixer", subject, "realtime_factor", (seconds > 0) ? DEFAULT_SECONDS / seconds : 0);
+    free(buffer);
+}
+
+static void bench_mixers(void)
+{
+    struct S3MPlayerContext* ctx = calloc(1, sizeof(struct S3MPlayerContext));
+    int mode, s;
+
+    ctx->sample_rate = SAMPLE_RATE;
+    ctx->mix_stereo = s3m_mix_select();
+    s3m_mix_init_tables();
+    make_sample(&ctx->sample[0], 8);
+    make_sample(&ctx->sample[1], 16);
+
+    for (mode = S3M_INTERPOLATION_NEAREST; mode <= S3M_INTERPOLATION_SINC; mode++) {
+        for (s = 0; s < 2; s++) {
+            bench_mixer(ctx, &ctx->sample[s], mode, 1);
+            bench_mixer(ctx, &ctx->sample[s], mode, 16);
+        }
+    }
+    /* The samples are laid out as the player's, so it can free them */
+    s3m_player_free(ctx);
+    free(ctx);
+}
+
+static int song_load(struct BenchSong* song)
+{
+    if (song->is_mod) {
+        FILE* fp = fopen(song->path, "rb");
+        int status = fp && load_mod(&song->mod, fp);
+        if (fp)
+            fclose(fp);
+        return status;
+    }
+    return s3m_load(&song->s3m, song->path);
+}
+
+static void song_unload(struct BenchSong* song)
+{
+    if (song->is_mod)
+        mod_unload(&song->mod);
+    else
+        s3m_unload(&song->s3m);
+}
+
+/* The benchmarks have nothing useful to do without a player, so give up */
+static void song_player_init(struct BenchSong* song, struct S3MPlayerContext* ctx)
+{
+    int status;
+
+    if (song->is_mod)
+        status = mod_player_init(ctx, &song->mod, SAMPLE_RATE);
+    else
+        status = s3m_player_init(ctx, &song->s3m, SAMPLE_RATE);
+    if (!status) {
+        fprintf(stderr, "Can't initialise the player\n");
+        exit(1);
+    }
+}
+
+static long file_size(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    long size = 0;
+
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    return size;
+}
+
+/* Loads and unloads the file repeatedly; includes opening it each time */
+static void bench_load(struct BenchSong* song)
+{
+    const char* benchmark = song->is_mod ? "load_mod" : "load_s3m";
+    long size = file_size(song->path), loads = 0;
+    double seconds;
+    clock_t start = clock();
+
+    do {
+        if (!song_load(song))
+            return;
+        song_unload(song);
+        loads++;
+    } while ((seconds = cpu_seconds(start)) < MIN_CPU_SECONDS);
+
+    report(benchmark, song->name, "ns_per_load", seconds * 1e9 / loads);
+    if (seconds > 0)
+        report(benchmark, song->name, "mb_per_s", (double)size * loads / seconds / 1e6);
+}
+
+/* Decodes every packed pattern of an S3M; MODs have nothing to unpack */
+static void bench_unpack(struct BenchSong* song)
+{
+    struct S3MPattern pattern;
+    double seconds;
+    long patterns = 0;
+    clock_t start;
+    int i;
+
+    if (song->is_mod || song->s3m.header->pattern_count == 0)
+        return;
+
+    pattern.channels = 32;
+    pattern.entries = malloc(sizeof(struct S3MPatternEntry) * 64 * 32);
+    start = clock();
+    do {
+        for (i = 0; i < song->s3m.header->pattern_count; i++) {
+            s3m_pattern_init(&pattern);
+            s3m_pattern_unpack(&pattern, &song->s3m.packed_patterns[i]);
+        }
+        patterns += song->s3m.header->pattern_count;
+    } while ((seconds = cpu_seconds(start)) < MIN_CPU_SECONDS);
+    free(pattern.entries);
+
+    report("pattern_unpack", song->name, "ns_per_pattern", seconds * 1e9 / patterns);
+}
+
+/* Runs the ticks that audio_seconds of the song would take, without mixing */
+static void bench_tick(struct BenchSong* song, double audio_seconds)
+{
+    struct S3MPlayerContext* ctx = calloc(1, sizeof(struct S3MPlayerContext));
+    long ticks = 0, target;
+    double seconds;
+    clock_t start;
+
+    song_player_init(song, ctx);
+    target = (long)(audio_seconds * SAMPLE_RATE / ctx->samples_per_tick);
+    start = clock();
+    do {
+        s3m_process_tick(ctx);
+        ticks++;
+    } while (ticks < target || cpu_seconds(start) < MIN_CPU_SECONDS);
+    seconds = cpu_seconds(start);
+
+    report("process_tick", song->name, "ns_per_tick", seconds * 1e9 / ticks);
+    s3m_player_free(ctx);
+    free(ctx);
+}
+
+/* Finds the song's length with s3m_simulate, which never mixes */
+static void bench_simulate(struct BenchSong* song)
+{
+    struct S3MPlayerContext* ctx = calloc(1, sizeof(struct S3MPlayerContext));
+    struct S3MSongInfo info;
+    long runs = 0;
+    double seconds;
+    clock_t start;
+
+    song_player_init(song, ctx);
+    start = clock();
+    do {
+        s3m_simulate(ctx, &info);
+        runs++;
+    } while ((seconds = cpu_seconds(start)) < MIN_CPU_SECONDS);
+
+    report("simulate", song->name, "ns_per_song", seconds * 1e9 / runs);
+    report("simulate", song->name, "song_seconds", (double)info.length / SAMPLE_RATE);
+    report("simulate", song->name, "realtime_factor", (double)info.length * runs / SAMPLE_RATE / seconds);
+    s3m_player_free(ctx);
+    free(ctx);
+}
+
+/* Renders audio_seconds of the song, or until it ends */
+static void bench_render(struct BenchSong* song, double audio_seconds)
+{
+    struct S3MPlayerContext* ctx = calloc(1, sizeof(struct S3MPlayerContext));
+    float* buffer = malloc(sizeof(float) * BENCH_FRAMES * 2);
+    long frames = 0, target = (long)(audio_seconds * SAMPLE_RATE);
+    double voice_frames = 0, seconds;
+    clock_t start;
+
+    song_player_init(song, ctx);
+    start = clock();
+    while (frames < target && ctx->loop_count == 0) {
+        s3m_render_audio(buffer, BENCH_FRAMES, ctx);
+        frames += BENCH_FRAMES;
+        voice_frames += (double)ctx->active_voice_count * BENCH_FRAMES;
+    }
+    seconds = cpu_seconds(start);
+
+    report("render", song->name, "ns_per_frame", seconds * 1e9 / frames);
+    if (voice_frames > 0)
+        report("render", song->name, "ns_per_frame_voice", seconds * 1e9 / voice_frames);
+    report("render", song->name, "average_voices", voice_frames / frames);
+    report("render", song->name, "realtime_factor", (seconds > 0) ? frames / (double)SAMPLE_RATE / seconds : 0);
+    free(buffer);
+    s3m_player_free(ctx);
+    free(ctx);
+}
+
+/*
+ * The same render with the voices mixed on threads threads. CPU time adds
+ * up over every thread, so this one is timed on the wall clock.
+ */
+static void bench_render_parallel(struct BenchSong* song, double audio_seconds, int threads)
+{
+    struct S3MPlayerContext* ctx = calloc(1, sizeof(struct S3MPlayerContext));
+    float* buffer = malloc(sizeof(float) * BENCH_FRAMES * 2);
+    long frames = 0, target = (long)(audio_seconds * SAMPLE_RATE);
+    double start, seconds;
+
+    song_player_init(song, ctx);
+    if (!s3m_set_mix_threads(ctx, threads)) {
+        fprintf(stderr, "Can't start %d mixing threads\n", threads);
+        free(buffer);
+        s3m_player_free(ctx);
+        free(ctx);
+        return;
+    }
+    start = s3m_wall_seconds();
+    while (frames < target && ctx->loop_count == 0) {
+        s3m_render_audio(buffer, BENCH_FRAMES, ctx);
+        frames += BENCH_FRAMES;
+    }
+    seconds = s3m_wall_seconds() - start;
+
+    report("render_parallel", song->name, "threads", threads);
+    report("render_parallel", song->name, "ns_per_frame", seconds * 1e9 / frames);
+    report("render_parallel", song->name, "realtime_factor", (seconds > 0) ? frames / (double)SAMPLE_RATE / seconds : 0);
+    free(buffer);
+    s3m_player_free(ctx);
+    free(ctx);
+}
+
+static void bench_song(struct BenchSong* song, double audio_seconds, int mix_threads)
+{
+    bench_load(song);
+    if (!song_load(song)) {
+        fprintf(stderr, "Can't load %s\n", song->path);
+        return;
+    }
+    bench_unpack(song);
+    bench_tick(song, audio_seconds);
+    bench_simulate(song);
+    bench_render(song, audio_seconds);
+    if (mix_threads > 1)
+        bench_render_parallel(song, audio_seconds, mix_threads);
+    song_unload(song);
+}
+
+static int is_mod_file(const char* path)
+{
+    size_t n = strlen(path);
+    return n >= 4 && (strcmp(&path[n - 4], ".mod") == 0 || strcmp(&path[n - 4], ".MOD") == 0);
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options] [file.s3m|file.mod ...]\n"
+        "Without files, benchmarks the mixer and a set of generated modules.\n"
+        "  -t <seconds>   Audio to render per module (default: %d)\n"
+        "  -d <dir>       Directory for generated modules (default: .)\n"
+        "  -m <threads>   Also render with the voices mixed on this many threads\n",
+        program, DEFAULT_SECONDS);
+}
+
+int main(int argc, char* argv[])
+{
+    struct BenchSong* song;
+    double audio_seconds = DEFAULT_SECONDS;
+    const char* dir = ".";
+    int i, files = 0, mix_threads = 1;
+
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] != '-') {
+            files++;
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            audio_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+            mix_threads = atoi(argv[++i]);
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    song = calloc(1, sizeof(struct BenchSong));
+    printf("benchmark\tsubject\tmetric\tvalue\n");
+    if (files) {
+        for (i = 1; i < argc; i++) {
+            if (argv[i][0] == '-') {
+                i++;
+                continue;
+            }
+            memset(song, 0, sizeof(struct BenchSong));
+            song->name = argv[i];
+            song->path = argv[i];
+            song->is_mod = is_mod_file(argv[i]);
+            bench_song(song, audio_seconds, mix_threads);
+        }
+    } else {
+        bench_mixers();
+        for (i = 0; i < (int)(sizeof(synth_suite) / sizeof(synth_suite[0])); i++) {
+            char path[1024];
+
+            sprintf(path, "%.900s/s3mbench-%s.%s", dir, synth_suite[i].name, synth_suite[i].is_mod ? "mod" : "s3m");
+            if (!synth_write(&synth_suite[i], path)) {
+                fprintf(stderr, "Can't write %s\n", path);
+                free(song);
+                return 1;
+            }
+            memset(song, 0, sizeof(struct BenchSong));
+            song->name = synth_suite[i].name;
+            song->path = path;
+            song->is_mod = synth_suite[i].is_mod;
+            bench_song(song, audio_seconds, mix_threads);
+            remove(path);
+        }
+    }
+
+    free(song);
+    return 0;
+}
@@ -0,0 +1,375 @@
+#include "synth.h"
+#include "mod.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SYNTH_PI 3.14159265358979323846
+#define SYNTH_SAMPLES 4
+
+struct SynthBuffer {
+    unsigned char* data;
+    long size;
+    long capacity;
+};
+
+/*
+ * Instruments shared by every generated module: a long and a short loop,
+ * a one-shot and (S3M only) a 16 bit loop.
+ */
+static const struct {
+    int length;
+    int loop_begin;
+    int loop_end; /* 0 for a one-shot sample */
+    int bits;
+    int volume;
+} synth_samples[SYNTH_SAMPLES] = {
+    { 65536, 0, 65536, 8, 48 },
+    { 256, 0, 256, 8, 40 },
+    { 8000, 0, 0, 8, 64 },
+    { 32768, 1024, 32768, 16, 44 }
+};
+
+/* S3M effects as command, info. Heavy ones keep running every tick. */
+static const unsigned char s3m_heavy_effects[][2] = {
+    { 4, 0x04 }, /* D04 */
+    { 4, 0x40 }, /* D40 */
+    { 4, 0xF1 }, /* DF1 */
+    { 5, 0x08 }, /* E08 */
+    { 6, 0x08 }, /* F08 */
+    { 7, 0x20 }, /* G20 */
+    { 8, 0x46 }, /* H46 */
+    { 10, 0x37 }, /* J37 */
+    { 11, 0x02 }, /* K02 */
+    { 12, 0x30 }, /* L30 */
+    { 17, 0x32 }, /* Q32 */
+    { 18, 0x46 } /* R46 */
+};
+
+static const unsigned char s3m_light_effects[][2] = {
+    { 15, 0x04 }, /* O04 */
+    { 19, 0x83 }, /* S83 */
+    { 19, 0x8C } /* S8C */
+};
+
+/* MOD effects as effect, data, limited to those the player converts */
+static const unsigned char mod_heavy_effects[][2] = {
+    { 0xA, 0x04 },
+    { 0xA, 0x40 },
+    { 0x1, 0x04 },
+    { 0x2, 0x04 },
+    { 0x3, 0x20 },
+    { 0x0, 0x37 },
+    { 0x5, 0x02 },
+    { 0x6, 0x02 }
+};
+
+static const unsigned char mod_light_effects[][2] = {
+    { 0xC, 0x20 },
+    { 0xC, 0x30 }
+};
+
+#define COUNT_OF(a) (int)(sizeof(a) / sizeof((a)[0]))
+
+/* B or C, in the format's numbering, for the channel's cell on the jump row */
+static int synth_jump(const struct SynthModule* synth, int pattern, int row, int channel, int is_mod, unsigned char command[2])
+{
+    if (!synth->jump_order || pattern != synth->patterns - 1 || row != 63 || channel > 1)
+        return 0;
+    if (channel == 0) {
+        command[0] = is_mod ? 0xB : 2;
+        command[1] = synth->jump_order;
+    } else {
+        command[0] = is_mod ? 0xD : 3;
+        command[1] = (synth->jump_row / 10) << 4 | synth->jump_row % 10;
+    }
+    return 1;
+}
+
+static unsigned long synth_seed;
+
+/* A fixed LCG so modules don't depend on the C library's rand() */
+static int synth_rand(int n)
+{
+    synth_seed = (synth_seed * 1103515245UL + 12345UL) & 0xFFFFFFFFUL;
+    return (int)((synth_seed >> 16) & 0x7FFF) % n;
+}
+
+static long buffer_grow(struct SynthBuffer* buf, long bytes)
+{
+    long offset = buf->size;
+
+    if (buf->size + bytes > buf->capacity) {
+        long capacity = buf->capacity ? buf->capacity : 65536;
+        while (capacity < buf->size + bytes)
+            capacity *= 2;
+        buf->data = realloc(buf->data, capacity);
+        if (buf->data == NULL) {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        buf->capacity = capacity;
+    }
+    memset(&buf->data[offset], 0, bytes);
+    buf->size += bytes;
+    return offset;
+}
+
+static void set_le16(struct SynthBuffer* buf, long offset, unsigned int value)
+{
+    buf->data[offset] = value & 0xFF;
+    buf->data[offset + 1] = (value >> 8) & 0xFF;
+}
+
+static void set_le32(struct SynthBuffer* buf, long offset, unsigned long value)
+{
+    set_le16(buf, offset, value & 0xFFFF);
+    set_le16(buf, offset + 2, (value >> 16) & 0xFFFF);
+}
+
+static void set_be16(struct SynthBuffer* buf, long offset, unsigned int value)
+{
+    buf->data[offset] = (value >> 8) & 0xFF;
+    buf->data[offset + 1] = value & 0xFF;
+}
+
+static void put8(struct SynthBuffer* buf, int value)
+{
+    long offset = buffer_grow(buf, 1); /* May move buf->data */
+    buf->data[offset] = value & 0xFF;
+}
+
+/* Parapointers address 16 byte paragraphs */
+static void pad_to_paragraph(struct SynthBuffer* buf)
+{
+    if (buf->size % 16)
+        buffer_grow(buf, 16 - buf->size % 16);
+}
+
+/* Frame i of a sample, signed and at the sample's bit depth */
+static int synth_sample_frame(int sample, int i)
+{
+    switch (sample) {
+    case 0: /* Saw with a sine on top */
+        return ((i * 3) % 256 - 128) / 2 + (int)(60 * sin(2 * SYNTH_PI * i / 97.0));
+    case 1: /* Square */
+        return ((i / 16) % 2) ? 100 : -100;
+    case 2: /* Decaying noise */
+        return (int)((synth_rand(241) - 120) * exp(-i / 2000.0));
+    default: /* Sine */
+        return (int)(20000 * sin(2 * SYNTH_PI * i / 37.0));
+    }
+}
+
+/* True if this cell starts a note; *effect is set to an index or -1 */
+static int synth_cell(const struct SynthModule* synth, int heavy_count, int light_count, int* effect, int* is_heavy)
+{
+    int has_note = synth_rand(100) < synth->note_density;
+
+    *effect = -1;
+    *is_heavy = 0;
+    if (synth->effect_heavy) {
+        /* Most notes and some empty cells carry a running effect */
+        if (synth_rand(100) < (has_note ? 80 : 20)) {
+            *effect = synth_rand(heavy_count);
+            *is_heavy = 1;
+        }
+    } else if (has_note && synth_rand(100) < 10) {
+        *effect = synth_rand(light_count);
+    }
+    return has_note;
+}
+
+static void synth_s3m_patterns(const struct SynthModule* synth, struct SynthBuffer* buf, long pattern_table)
+{
+    int played[32];
+    int p, r, c;
+
+    memset(played, 0, sizeof(played));
+    for (p = 0; p < synth->patterns; p++) {
+        long start;
+
+        pad_to_paragraph(buf);
+        set_le16(buf, pattern_table + p * 2, buf->size / 16);
+        start = buffer_grow(buf, 2);
+        for (r = 0; r < 64; r++) {
+            for (c = 0; c < synth->channels; c++) {
+                const unsigned char* command = NULL;
+                unsigned char jump[2];
+                int effect, is_heavy, has_volume;
+                int has_note = synth_cell(synth, COUNT_OF(s3m_heavy_effects), COUNT_OF(s3m_light_effects), &effect, &is_heavy);
+
+                if (effect >= 0)
+                    command = is_heavy ? s3m_heavy_effects[effect] : s3m_light_effects[effect];
+                /* Tone portamento needs a note to start from */
+                if (command && command[0] == 7 && !played[c])
+                    command = NULL;
+                if (synth_jump(synth, p, r, c, 0, jump))
+                    command = jump;
+                if (!has_note && !command)
+                    continue;
+
+                has_volume = has_note && synth_rand(4) == 0;
+                put8(buf, c | (has_note ? 0x20 : 0) | (has_volume ? 0x40 : 0) | (command ? 0x80 : 0));
+                if (has_note) {
+                    put8(buf, (3 + synth_rand(3)) << 4 | synth_rand(12));
+                    put8(buf, 1 + synth_rand(SYNTH_SAMPLES));
+                    played[c] = 1;
+                }
+                if (has_volume)
+                    put8(buf, 16 + synth_rand(49));
+                if (command) {
+                    put8(buf, command[0]);
+                    put8(buf, command[1]);
+                }
+            }
+            put8(buf, 0);
+        }
+        /* Like ST3, the length includes the length word itself */
+        set_le16(buf, start, buf->size - start);
+    }
+}
+
+static void synth_build_s3m(const struct SynthModule* synth, struct SynthBuffer* buf)
+{
+    int order_count = (synth->patterns + 2) & ~1; /* Room for an end marker, even */
+    long instrument_table, pattern_table, headers[SYNTH_SAMPLES];
+    int i, j;
+
+    buffer_grow(buf, 0x60);
+    memcpy(buf->data, synth->name, strlen(synth->name) < 27 ? strlen(synth->name) : 27);
+    buf->data[0x1C] = 0x1A;
+    buf->data[0x1D] = 16;
+    set_le16(buf, 0x20, order_count);
+    set_le16(buf, 0x22, SYNTH_SAMPLES);
+    set_le16(buf, 0x24, synth->patterns);
+    set_le16(buf, 0x28, 0x1320);
+    set_le16(buf, 0x2A, 2); /* Unsigned samples */
+    memcpy(&buf->data[0x2C], "SCRM", 4);
+    buf->data[0x30] = 64; /* Global volume */
+    buf->data[0x31] = 6; /* Speed */
+    buf->data[0x32] = 125; /* Tempo */
+    buf->data[0x33] = 0xB0; /* Stereo, master volume 0x30 */
+    buf->data[0x34] = 16;
+    /* Channels alternate left and right, reusing settings past 16 */
+    for (i = 0; i < 32; i++)
+        buf->data[0x40 + i] = (i < synth->channels) ? ((i & 1) ? 8 : 0) + (i / 2) % 8 : 255;
+
+    for (i = 0; i < order_count; i++)
+        put8(buf, (i < synth->patterns) ? i : 0xFF);
+    instrument_table = buffer_grow(buf, SYNTH_SAMPLES * 2);
+    pattern_table = buffer_grow(buf, synth->patterns * 2);
+
+    for (i = 0; i < SYNTH_SAMPLES; i++) {
+        pad_to_paragraph(buf);
+        set_le16(buf, instrument_table + i * 2, buf->size / 16);
+        headers[i] = buffer_grow(buf, 0x50);
+        buf->data[headers[i]] = 1;
+        memcpy(&buf->data[headers[i] + 0x01], "SYNTH.RAW", 9);
+        set_le32(buf, headers[i] + 0x10, synth_samples[i].length);
+        set_le32(buf, headers[i] + 0x14, synth_samples[i].loop_begin);
+        set_le32(buf, headers[i] + 0x18, synth_samples[i].loop_end);
+        buf->data[headers[i] + 0x1C] = synth_samples[i].volume;
+        buf->data[headers[i] + 0x1F] = (synth_samples[i].loop_end ? 1 : 0) | (synth_samples[i].bits == 16 ? 4 : 0);
+        set_le32(buf, headers[i] + 0x20, 8363);
+        memcpy(&buf->data[headers[i] + 0x4C], "SCRS", 4);
+    }
+
+    synth_s3m_patterns(synth, buf, pattern_table);
+
+    for (i = 0; i < SYNTH_SAMPLES; i++) {
+        long memseg;
+
+        pad_to_paragraph(buf);
+        memseg = buf->size / 16;
+        buf->data[headers[i] + 0x0D] = (memseg >> 16) & 0xFF;
+        set_le16(buf, headers[i] + 0x0E, memseg & 0xFFFF);
+        for (j = 0; j < synth_samples[i].length; j++) {
+            int v = synth_sample_frame(i, j);
+            if (synth_samples[i].bits == 16) {
+                put8(buf, (v + 32768) & 0xFF);
+                put8(buf, ((v + 32768) >> 8) & 0xFF);
+            } else {
+                put8(buf, v + 128);
+            }
+        }
+    }
+}
+
+static void synth_build_mod(const struct SynthModule* synth, struct SynthBuffer* buf)
+{
+    int channels = (synth->channels > 4) ? 8 : 4;
+    int i, j, r, c;
+
+    buffer_grow(buf, 0x43C);
+    memcpy(buf->data, synth->name, strlen(synth->name) < 20 ? strlen(synth->name) : 20);
+    for (i = 0; i < SYNTH_SAMPLES; i++) {
+        long record = 20 + i * 30;
+        set_be16(buf, record + 22, synth_samples[i].length / 2);
+        buf->data[record + 25] = synth_samples[i].volume;
+        set_be16(buf, record + 26, synth_samples[i].loop_begin / 2);
+        set_be16(buf, record + 28, synth_samples[i].loop_end
+            ? (synth_samples[i].loop_end - synth_samples[i].loop_begin) / 2
+            : 1);
+    }
+    buf->data[950] = synth->patterns;
+    buf->data[951] = 127;
+    for (i = 0; i < synth->patterns; i++)
+        buf->data[952 + i] = i;
+    memcpy(&buf->data[0x438], (channels == 8) ? "8CHN" : "M.K.", 4);
+
+    for (i = 0; i < synth->patterns; i++) {
+        for (r = 0; r < 64; r++) {
+            for (c = 0; c < channels; c++) {
+                long cell = buffer_grow(buf, 4);
+                const unsigned char* effect = NULL;
+                unsigned char jump[2];
+                int index, is_heavy;
+
+                if (synth_cell(synth, COUNT_OF(mod_heavy_effects), COUNT_OF(mod_light_effects), &index, &is_heavy)) {
+                    int period = amiga_period_table[12 + synth_rand(36)];
+                    int inst = 1 + synth_rand(SYNTH_SAMPLES);
+                    buf->data[cell] = (inst & 0xF0) | ((period >> 8) & 0x0F);
+                    buf->data[cell + 1] = period & 0xFF;
+                    buf->data[cell + 2] = (inst & 0x0F) << 4;
+                }
+                if (index >= 0)
+                    effect = is_heavy ? mod_heavy_effects[index] : mod_light_effects[index];
+                if (synth_jump(synth, i, r, c, 1, jump))
+                    effect = jump;
+                if (effect) {
+                    buf->data[cell + 2] |= effect[0];
+                    buf->data[cell + 3] = effect[1];
+                }
+            }
+        }
+    }
+
+    /* MOD samples are signed 8 bit, so the 16 bit one loses its low byte */
+    for (i = 0; i < SYNTH_SAMPLES; i++)
+        for (j = 0; j < synth_samples[i].length; j++) {
+            int v = synth_sample_frame(i, j);
+            put8(buf, (synth_samples[i].bits == 16) ? v >> 8 : v);
+        }
+}
+
+int synth_write(const struct SynthModule* synth, const char* filename)
+{
+    struct SynthBuffer buf = { NULL, 0, 0 };
+    FILE* fp;
+    int status;
+
+    synth_seed = 1;
+    if (synth->is_mod)
+        synth_build_mod(synth, &buf);
+    else
+        synth_build_s3m(synth, &buf);
+
+    fp = fopen(filename, "wb");
+    status = fp && fwrite(buf.data, 1, buf.size, fp) == (size_t)buf.size;
+    if (fp)
+        fclose(fp);
+    free(buf.data);
+    return status;
+}
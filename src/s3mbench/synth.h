@@ -0,0 +1,22 @@
+#ifndef _SYNTH_H_
+#define _SYNTH_H_
+
+/* A procedurally generated module for benchmarking */
+struct SynthModule {
+    const char* name;
+    int is_mod; /* MOD (4 or 8 channels) instead of S3M */
+    int channels;
+    int patterns;
+    int note_density; /* Percentage of cells that start a note */
+    int effect_heavy; /* Most notes carry a running effect rather than a few */
+    int jump_order; /* If nonzero, the last row jumps back to this order with B */
+    int jump_row; /* Row the jump resumes at, set with C next to the B */
+};
+
+/*
+ * Writes the module to filename. The same parameters always produce the
+ * same file. Returns 0 if the file can't be written.
+ */
+extern int synth_write(const struct SynthModule* synth, const char* filename);
+
+#endif
@@ -40,20 +40,19 @@ struct ModPatternEntry {
     unsigned char effect_data;
 };
 
-struct ModPattern {
-    struct ModPatternEntry row[64][8];
-};
-
 struct Mod {
+    unsigned char* file_data; /* Whole file; sample data points into it */
     char song_title[20];
     struct ModSample samples[31];
-    char song_length;
-    char pattern_count;
-    char pattern_table[128];
-    struct ModPattern pattern[128];
+    int song_length; /* Orders played, at most 128 */
+    int pattern_count; /* Patterns stored in the file */
+    unsigned char pattern_table[128];
+    const unsigned char* pattern_data; /* Raw cells, decoded on demand */
     int num_channels;
 };
 
 extern int load_mod(struct Mod* mod, FILE* fp);
+extern void mod_unload(struct Mod* mod);
+extern void mod_read_pattern_entry(const struct Mod* mod, int pattern, int row, int channel, struct ModPatternEntry* entry);
 extern int amiga_period_table[];
 #endif
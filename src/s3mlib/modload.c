@@ -11,28 +11,26 @@ int amiga_period_table[] = {
     107, 101, 95, 90, 85, 80, 75, 71, 67, 63, 60, 56
 };
 
-int fread_big_endian_word(FILE* fp)
+static int read_big_endian_word(const unsigned char* p)
 {
-    unsigned char hi_byte = 0, lo_byte = 0;
-    fread(&hi_byte, sizeof(char), 1, fp);
-    fread(&lo_byte, sizeof(char), 1, fp);
-    return hi_byte << 8 | lo_byte;
+    return p[0] << 8 | p[1];
 }
 
-void read_sample_record(struct ModSample* rec, FILE* fp)
+/* Sample records are 30 bytes: name, length, finetune, volume, loop */
+static void read_sample_record(struct ModSample* rec, const unsigned char* p)
 {
-    fread(rec->name, sizeof(char), 22, fp);
-    rec->length = fread_big_endian_word(fp) * 2;
-    fread(&rec->fine_tuning, sizeof(char), 1, fp);
-    if ((rec->fine_tuning &= 0x0F) & 0x08)
+    memcpy(rec->name, p, 22);
+    rec->length = read_big_endian_word(&p[22]) * 2;
+    rec->fine_tuning = p[24] & 0x0F;
+    if (rec->fine_tuning & 0x08)
         rec->fine_tuning |= 0xF0; /* Manual sign extension */
-    fread(&rec->volume, sizeof(char), 1, fp);
+    rec->volume = p[25];
 
-    rec->loop_point = fread_big_endian_word(fp) * 2;
-    rec->loop_length = fread_big_endian_word(fp) * 2;
+    rec->loop_point = read_big_endian_word(&p[26]) * 2;
+    rec->loop_length = read_big_endian_word(&p[28]) * 2;
 
-    if (rec->loop_length > 2)
-        rec->is_looping = 1;
+    rec->is_looping = (rec->loop_length > 2);
+    rec->data = NULL;
 }
 
 int index_of_period(int period)
@@ -44,53 +42,48 @@ int index_of_period(int period)
     return -1;
 }
 
-void read_pattern_entry(struct ModPatternEntry* entry, FILE* fp)
+/* Pattern cells are 4 bytes, 64 rows of num_channels cells per pattern */
+void mod_read_pattern_entry(const struct Mod* mod, int pattern, int row, int channel, struct ModPatternEntry* entry)
 {
-    unsigned char channel_data[4];
+    const unsigned char* channel_data = &mod->pattern_data[((pattern * 64 + row) * mod->num_channels + channel) * 4];
 
-    fread(channel_data, sizeof(char), 4, fp);
     entry->note_period = (channel_data[0] & 0x0f) << 8 | channel_data[1];
     entry->instrument = (channel_data[0] & 0xf0) | (channel_data[2] >> 4);
     entry->effect = channel_data[2] & 0x0f;
     entry->effect_data = channel_data[3];
 }
 
-void read_pattern(struct ModPattern* pattern, int num_channels, FILE* fp)
+/*
+ * Layout: 20 byte title, 31 sample records, song length, restart byte,
+ * 128 byte pattern table, signature, then pattern and sample data.
+ */
+static int parse_mod(struct Mod* mod, const unsigned char* data, long size)
 {
-    int i, j;
-    for (i = 0; i < 64; i++)
-        for (j = 0; j < num_channels; j++)
-            read_pattern_entry(&pattern->row[i][j], fp);
-}
-
-int load_mod(struct Mod* mod, FILE* fp)
-{
-    char signature[5];
+    const unsigned char* p;
+    long pattern_bytes, offset;
     int i;
 
-    fseek(fp, 0x438, SEEK_SET);
-    fread(signature, sizeof(char), 4, fp);
-    signature[4] = '\0';
+    if (size < 0x43C)
+        return 0;
 
     /* Check for "M.K." signature */
-    if (strncmp(signature, "M.K.", 4) == 0)
+    if (memcmp(&data[0x438], "M.K.", 4) == 0)
         mod->num_channels = 4;
-    else if (strncmp(signature, "8CHN", 4) == 0)
+    else if (memcmp(&data[0x438], "8CHN", 4) == 0)
         mod->num_channels = 8;
     else
         return 0;
 
-    rewind(fp);
-    fread(mod->song_title, sizeof(char), 20, fp);
+    memcpy(mod->song_title, data, 20);
 
     /* There are always 31 sample records. Empty samples are indicated by lengths of 0 */
-    for (i = 0; i < 31; i++)
-        read_sample_record(&mod->samples[i], fp);
+    for (i = 0, p = &data[20]; i < 31; i++, p += 30)
+        read_sample_record(&mod->samples[i], p);
 
-    fread(&mod->song_length, sizeof(char), 1, fp);
-    /* Skip a (typically) unused byte */
-    fseek(fp, 1, SEEK_CUR);
-    fread(mod->pattern_table, sizeof(char), 128, fp);
+    mod->song_length = data[950];
+    memcpy(mod->pattern_table, &data[952], 128);
+    if (mod->song_length > 128)
+        mod->song_length = 128;
 
     /* The number of patterns is equal to the highest value in the pattern table */
     for (i = 0, mod->pattern_count = 0; i < 128; i++)
@@ -98,24 +91,56 @@ int load_mod(struct Mod* mod, FILE* fp)
             mod->pattern_count = mod->pattern_table[i];
     mod->pattern_count++;
 
-    /* Skip already loaded signature */
-    fseek(fp, 4, SEEK_CUR);
-
-    /* Begins pattern data. 4 bytes * #channels * 64 rows*/
-    for (i = 0; i < mod->pattern_count; i++)
-        read_pattern(&mod->pattern[i], mod->num_channels, fp);
-
-    printf("Start of Sample Data %d", (int)ftell(fp));
+    /* Begins pattern data. 4 bytes * #channels * 64 rows; a file too
+     * short to hold every pattern the table names is rejected. */
+    pattern_bytes = 4L * mod->num_channels * 64;
+    offset = 0x43C;
+    if (size - offset < pattern_bytes * mod->pattern_count)
+        return 0;
+    mod->pattern_data = &data[offset];
+    offset += pattern_bytes * mod->pattern_count;
 
-    /* Sample data follows pattern data */
+    /* Sample data follows pattern data, truncated if the file is short */
     for (i = 0; i < 31; i++) {
-        if (mod->samples[i].length) {
-            printf("Reading Sample #%d\n", i);
-            printf("Length %d, Loop: %d Loop_Len: %d\n", mod->samples[i].length, mod->samples[i].loop_point, mod->samples[i].loop_length);
-            mod->samples[i].data = malloc(sizeof(char) * mod->samples[i].length);
-            fread(mod->samples[i].data, sizeof(char), mod->samples[i].length, fp);
+        struct ModSample* sample = &mod->samples[i];
+        if (sample->length > size - offset)
+            sample->length = size - offset;
+        if (sample->length) {
+            sample->data = (char*)&data[offset];
+            offset += sample->length;
         }
     }
 
     return 1;
 }
+
+/*
+ * Reads the whole file with a single fread and parses it from memory.
+ * Sample data points into that buffer, which stays owned by the Mod
+ * until mod_unload.
+ */
+int load_mod(struct Mod* mod, FILE* fp)
+{
+    long size;
+
+    mod->file_data = NULL;
+    if (fseek(fp, 0, SEEK_END) != 0 || (size = ftell(fp)) <= 0)
+        return 0;
+    rewind(fp);
+
+    mod->file_data = malloc(size);
+    if (mod->file_data == NULL)
+        return 0;
+    if (fread(mod->file_data, 1, size, fp) != (size_t)size
+        || !parse_mod(mod, mod->file_data, size)) {
+        mod_unload(mod);
+        return 0;
+    }
+    return 1;
+}
+
+void mod_unload(struct Mod* mod)
+{
+    free(mod->file_data);
+    mod->file_data = NULL;
+}
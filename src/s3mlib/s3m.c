@@ -1,15 +1,16 @@
 #include "s3m.h"
 #include "mod.h"
+#include "s3matomic.h"
+#include "s3mevent.h"
+#include "s3mmix.h"
+#include "s3mmixpool.h"
+#include "s3mthread.h"
 #include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #define PATTERN_ROWS 64
-#define PATTERN_CHANNELS 32
-#ifndef M_PI
-#define M_PI 3.14159265358979323846264338327950288
-#endif
 
 static struct S3MPatternEntry empty_note = { 0xFF, 0x00, 0xFF, 0xFF, 0x00 };
 
@@ -34,7 +35,7 @@ static char command_names[] = ".ABCDEFGHIJKLMNOPQRSTUVWXYZ";
  * 0123456789ABC
  * 14 characters including null terminator
  */
-void render_pattern_entry(char *buf, const struct S3MPatternEntry* entry) {
+void s3m_format_pattern_entry(char *buf, const struct S3MPatternEntry* entry) {
     char empty_entry[] = "... .. .. .00";
     char digit_buf[16];
     strncpy(buf, empty_entry, 16);
@@ -71,16 +72,9 @@ void render_pattern_entry(char *buf, const struct S3MPatternEntry* entry) {
     }
 }
 
-void print_row(struct S3MPattern* pattern, int row) {
-    int i;
-    char buffer[16];
-    char *prefix = "";
-    for (i = 0; i < 8; i++) {
-        render_pattern_entry(buffer, &pattern->row[row][i]);
-        printf("%s%s", prefix, buffer);
-        prefix = " | ";
-    }
-    printf("\n");
+static struct S3MPatternEntry* s3m_pattern_row(struct S3MPattern* pattern, int row)
+{
+    return &pattern->entries[row * pattern->channels];
 }
 
 enum S3MEffect {
@@ -124,6 +118,60 @@ static const int st3period_table[] = {
     907 /* B  */
 };
 
+/*
+ * Vibrato and tremolo waveforms, 64 steps per cycle with an amplitude of
+ * 255. The sine is the one ST3 and ProTracker use; the random waveform is
+ * a fixed table so renders are repeatable.
+ */
+static const short waveform_table[4][64] = {
+    { /* Sine */
+        0, 24, 49, 74, 97, 120, 141, 161,
+        180, 197, 212, 224, 235, 244, 250, 253,
+        255, 253, 250, 244, 235, 224, 212, 197,
+        180, 161, 141, 120, 97, 74, 49, 24,
+        0, -24, -49, -74, -97, -120, -141, -161,
+        -180, -197, -212, -224, -235, -244, -250, -253,
+        -255, -253, -250, -244, -235, -224, -212, -197,
+        -180, -161, -141, -120, -97, -74, -49, -24
+    },
+    { /* Ramp down */
+        255, 248, 240, 232, 224, 216, 208, 200,
+        192, 184, 176, 168, 160, 152, 144, 136,
+        128, 120, 112, 104, 96, 88, 80, 72,
+        64, 56, 48, 40, 32, 24, 16, 8,
+        0, -8, -16, -24, -32, -40, -48, -56,
+        -64, -72, -80, -88, -96, -104, -112, -120,
+        -128, -136, -144, -152, -160, -168, -176, -184,
+        -192, -200, -208, -216, -224, -232, -240, -248
+    },
+    { /* Square */
+        255, 255, 255, 255, 255, 255, 255, 255,
+        255, 255, 255, 255, 255, 255, 255, 255,
+        255, 255, 255, 255, 255, 255, 255, 255,
+        255, 255, 255, 255, 255, 255, 255, 255,
+        -255, -255, -255, -255, -255, -255, -255, -255,
+        -255, -255, -255, -255, -255, -255, -255, -255,
+        -255, -255, -255, -255, -255, -255, -255, -255,
+        -255, -255, -255, -255, -255, -255, -255, -255
+    },
+    { /* Random */
+        -134, 48, 23, -189, -66, 213, 54, -13,
+        65, 42, -222, 55, -249, 210, 173, -15,
+        -123, 27, -136, -157, 254, 112, -15, 21,
+        173, 26, -12, -52, 72, 185, -178, -137,
+        70, -178, 189, 219, 12, -56, 124, -248,
+        88, 142, -223, -174, 133, 235, 47, -234,
+        -101, 144, -240, 166, 188, -118, -13, 49,
+        113, 216, 194, -57, 110, 148, 216, -37
+    }
+};
+
+/* Positions advance 4 per speed unit, so 256 positions make one cycle */
+static int s3m_waveform(int waveform, int position)
+{
+    return waveform_table[waveform & 3][(position >> 2) & 63];
+}
+
 static int get_note_st3period(int raw_note, int c2speed)
 {
     int octave = raw_note >> 4;
@@ -162,6 +210,9 @@ void s3m_pattern_unpack(struct S3MPattern* pattern, struct S3MPackedPattern* pac
         channel = *data & 0x1F;
         flags = *data & 0xE0;
         data++;
+        /* A truncated pattern ends at the last whole cell */
+        if (data_end - data < ((flags & 0x20) ? 2 : 0) + ((flags & 0x40) ? 1 : 0) + ((flags & 0x80) ? 2 : 0))
+            break;
         if (flags & 0x20) {
             entry.note = *data++;
             entry.inst = *data++;
@@ -173,27 +224,258 @@ void s3m_pattern_unpack(struct S3MPattern* pattern, struct S3MPackedPattern* pac
             entry.command = *data++;
             entry.cominfo = *data++;
         }
-        pattern->row[row][channel] = entry;
+        /* Columns past the song's channel count are never played */
+        if (channel < pattern->channels)
+            s3m_pattern_row(pattern, row)[channel] = entry;
     }
 }
 
 void s3m_pattern_init(struct S3MPattern* pattern)
 {
-    int i, j;
-    for (i = 0; i < PATTERN_ROWS; i++) {
-        for (j = 0; j < PATTERN_CHANNELS; j++) {
-            pattern->row[i][j] = empty_note;
+    int i;
+    for (i = 0; i < PATTERN_ROWS * pattern->channels; i++)
+        pattern->entries[i] = empty_note;
+}
+
+/*
+ * Builds the event list from the decoded cells of the enabled channels.
+ * Empty cells and cells with no command (0 or 255) and nothing else are
+ * dropped, and instrument numbers out of range are cleared.
+ */
+static void s3m_pattern_compile(struct S3MPattern* pattern, unsigned long enabled_channels)
+{
+    int r, c, count = 0;
+
+    for (r = 0; r < PATTERN_ROWS; r++) {
+        const struct S3MPatternEntry* row = s3m_pattern_row(pattern, r);
+
+        pattern->row_events[r] = count;
+        pattern->row_channels[r] = 0;
+        for (c = 0; c < pattern->channels; c++) {
+            struct S3MRowEvent* event = &pattern->events[count];
+
+            if (!(enabled_channels >> c & 1))
+                continue;
+            if (row[c].note == 0xFF && row[c].inst == 0 && row[c].vol == 0xFF
+                && (row[c].command == 0xFF || row[c].command == ST3_EFFECT_UNUSED0))
+                continue;
+            event->channel = c;
+            event->cell = row[c];
+            if (event->cell.inst > 99)
+                event->cell.inst = 0;
+            pattern->row_channels[r] |= 1UL << c;
+            count++;
+        }
+    }
+    pattern->row_events[PATTERN_ROWS] = count;
+}
+
+static void s3m_file_pattern_decode(struct S3MPlayerContext* ctx, struct S3MPattern* pattern, int index)
+{
+    const struct S3MFile* file = ctx->song;
+
+    s3m_pattern_init(pattern);
+    if (index < 0 || index >= file->header->pattern_count)
+        return;
+    s3m_pattern_unpack(pattern, (struct S3MPackedPattern*)&file->packed_patterns[index]);
+}
+
+/* Needs ctx->num_channels set to size the slots; returns 0 if out of memory */
+static int s3m_pattern_cache_init(struct S3MPlayerContext* ctx, S3MPatternDecodeFunc decode, const void* song)
+{
+    int slot_entries = PATTERN_ROWS * ctx->num_channels;
+    struct S3MPattern* patterns = malloc(sizeof(struct S3MPattern) * S3M_PATTERN_CACHE_SIZE);
+    struct S3MPatternEntry* entries = malloc(sizeof(struct S3MPatternEntry) * slot_entries * S3M_PATTERN_CACHE_SIZE);
+    struct S3MRowEvent* events = malloc(sizeof(struct S3MRowEvent) * slot_entries * S3M_PATTERN_CACHE_SIZE);
+    int i;
+
+    if (patterns == NULL || entries == NULL || events == NULL) {
+        free(patterns);
+        free(entries);
+        free(events);
+        return 0;
+    }
+
+    for (i = 0; i < S3M_PATTERN_CACHE_SIZE; i++) {
+        patterns[i].channels = ctx->num_channels;
+        patterns[i].entries = &entries[i * slot_entries];
+        patterns[i].events = &events[i * slot_entries];
+        ctx->pattern_cache[i].pattern = -1;
+        ctx->pattern_cache[i].last_used = 0;
+        ctx->pattern_cache[i].data = &patterns[i];
+    }
+    ctx->pattern_cache_clock = 0;
+    ctx->decode_pattern = decode;
+    ctx->song = song;
+    return 1;
+}
+
+/*
+ * Returns the decoded pattern, decoding and compiling it into the least
+ * recently used cache slot if it isn't already cached.
+ */
+struct S3MPattern* s3m_get_pattern(struct S3MPlayerContext* ctx, int index)
+{
+    int i, victim = 0;
+
+    ctx->pattern_cache_clock++;
+    for (i = 0; i < S3M_PATTERN_CACHE_SIZE; i++) {
+        if (ctx->pattern_cache[i].pattern == index) {
+            ctx->pattern_cache[i].last_used = ctx->pattern_cache_clock;
+            return ctx->pattern_cache[i].data;
         }
+        if (ctx->pattern_cache[i].last_used < ctx->pattern_cache[victim].last_used)
+            victim = i;
     }
+
+    ctx->decode_pattern(ctx, ctx->pattern_cache[victim].data, index);
+    s3m_pattern_compile(ctx->pattern_cache[victim].data, ctx->enabled_channels);
+    ctx->pattern_cache[victim].pattern = index;
+    ctx->pattern_cache[victim].last_used = ctx->pattern_cache_clock;
+    return ctx->pattern_cache[victim].data;
 }
 
-void mod_player_init(struct S3MPlayerContext* ctx, struct Mod* mod, int sample_rate)
+/*
+ * Headroom for mixing num_channels voices. Up to 8 channels get the 1/8 the
+ * player always used. Above that it shrinks with the square root of the
+ * count, which is how fast a sum of unrelated voices grows, so a 32 channel
+ * song doesn't clip where an 8 channel one wouldn't.
+ */
+static float s3m_master_gain(int num_channels)
 {
+    if (num_channels < 8)
+        num_channels = 8;
+    return (float)(1.0 / sqrt(8.0 * num_channels));
+}
+
+/* Zeroed storage for a sample with guard frames on both sides; returns 0 if out of memory */
+static int s3m_sample_alloc(struct Sample* sample, int length, int bits)
+{
+    int frame_size = bits / 8;
+    char* data = calloc(length + 2 * S3M_SAMPLE_PAD, frame_size);
+
+    if (data == NULL)
+        return 0;
+    sample->sampledata = data + S3M_SAMPLE_PAD * frame_size;
+    sample->length = length;
+    sample->bits = bits;
+    return 1;
+}
+
+/*
+ * Clamps the loop to the sample and fills the guard frames after loop_end
+ * with the start of the loop. A looping sample never plays past its loop,
+ * so its length is cut to loop_end and the guard frames overwrite only
+ * data nothing reads. Must be called after the data is copied in.
+ */
+static void s3m_sample_set_loop(struct Sample* sample, int loop_begin, int loop_end)
+{
+    char* data = sample->sampledata;
+    int frame_size = sample->bits / 8;
     int i;
 
+    if (loop_end > sample->length)
+        loop_end = sample->length;
+    if (loop_begin < 0 || loop_begin >= loop_end)
+        return;
+
+    sample->loop_begin = loop_begin;
+    sample->loop_end = loop_end;
+    sample->length = loop_end;
+    for (i = 0; i < S3M_SAMPLE_PAD; i++) {
+        int from = loop_begin + i % (loop_end - loop_begin);
+        memcpy(&data[(loop_end + i) * frame_size], &data[from * frame_size], frame_size);
+    }
+}
+
+/* Converts a MOD pattern into Scream Tracker notes and effects */
+static void mod_pattern_decode(struct S3MPlayerContext* ctx, struct S3MPattern* pattern, int index)
+{
+    const struct Mod* mod = ctx->song;
+    int r, c, j, note_index;
+
+    s3m_pattern_init(pattern);
+    if (index < 0 || index >= mod->pattern_count)
+        return;
+    for (r = 0; r < 64; r++)
+        for (c = 0; c < mod->num_channels; c++) {
+            struct S3MPatternEntry *entry = &s3m_pattern_row(pattern, r)[c];
+            struct ModPatternEntry modentry;
+
+            mod_read_pattern_entry(mod, index, r, c, &modentry);
+            if (modentry.note_period) {
+                note_index = -1;
+                /* find note index in amiga table */
+                for (j = 0; j < 60; j++)
+                    if (amiga_period_table[j] == modentry.note_period) {
+                        note_index = j;
+                        break;
+                    }
+                entry->note = (note_index / 12 + 2) << 4 | (note_index % 12);
+            }
+            entry->inst = modentry.instrument;
+            switch (modentry.effect) {
+            case MOD_EFFECT_SET_VOLUME:
+                entry->vol = modentry.effect_data;
+                break;
+            case MOD_EFFECT_ARPEGGIO:
+                if (modentry.effect_data) {
+                    entry->command = ST3_EFFECT_ARPEGGIO;
+                    entry->cominfo = modentry.effect_data;
+                }
+                break;
+            case MOD_EFFECT_SET_SPEED:
+                entry->command = (modentry.effect_data < 0x20) ? ST3_EFFECT_SET_SPEED : ST3_EFFECT_TEMPO;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE:
+                entry->command = ST3_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_VIBRATO_AND_VOLUME_SLIDE:
+                entry->command = ST3_EFFECT_VIBRATO_AND_VOLUME_SLIDE;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_PORTAMENTO:
+                entry->command = ST3_EFFECT_TONE_PORTAMENTO;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_SLIDE_UP:
+                entry->command = ST3_EFFECT_SLIDE_UP;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_SLIDE_DOWN:
+                entry->command = ST3_EFFECT_SLIDE_DOWN;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_POSITION_JUMP:
+                entry->command = ST3_EFFECT_JUMP_TO_ORDER;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_PATTERN_BREAK:
+                entry->command = ST3_EFFECT_BREAK_PATTERN;
+                entry->cominfo = modentry.effect_data;
+                break;
+            case MOD_EFFECT_VOLUME_SLIDE:
+                entry->command = ST3_EFFECT_VOLUME_SLIDE;
+                entry->cominfo = modentry.effect_data;
+                break;
+            default:
+                break;
+            }
+        }
+}
+
+/* Returns 0, with nothing left allocated, if out of memory or no order names a pattern */
+int mod_player_init(struct S3MPlayerContext* ctx, struct Mod* mod, int sample_rate)
+{
+    int i, j;
+
     memset(ctx, 0, sizeof(struct S3MPlayerContext));
 
     ctx->sample_rate = sample_rate;
+    ctx->mix_stereo = s3m_mix_select();
+    s3m_mix_init_tables();
 
     /* Default settings */
     ctx->current_row = 0;
@@ -201,6 +483,7 @@ void mod_player_init(struct S3MPlayerContext* ctx, struct Mod* mod, int sample_r
     ctx->tick_counter = ctx->song_speed;
     ctx->samples_until_next_tick = 0;
     ctx->sample_rate = sample_rate;
+    ctx->global_volume = 64;
     s3m_player_set_tempo(ctx, 125);
 
     /* Limits are multiplied by 4 to move into Scream Tracker periods */
@@ -213,95 +496,46 @@ void mod_player_init(struct S3MPlayerContext* ctx, struct Mod* mod, int sample_r
         if (mod->samples[i].length) {
             struct ModSample *mod_sample = &mod->samples[i];
             struct Sample *sample = &ctx->sample[i];
-            int j;
 
-            sample->length = mod_sample->length;
             sample->volume = mod_sample->volume;
             sample->c2_speed = 8363 * pow(2.0, mod_sample->fine_tuning / (12.0 * 9.0));
-            sample->sampledata = malloc(sizeof(float) * sample->length);
 
-            /* Convert Sample data to float (0-255) -> (-1.0-1.0) */
-            for (j = 0; j <  sample->length; j++)
-                sample->sampledata[j] = 2.0 * (mod_sample->data[j] + 128) / 255.0 - 1.0;
-
-            if (mod_sample->is_looping) {
-                ctx->sample[i].loop_begin = mod_sample->loop_point;
-                ctx->sample[i].loop_end = mod_sample->loop_point + mod_sample->loop_length;
+            /* MOD samples are already signed 8 bit */
+            if (!s3m_sample_alloc(sample, mod_sample->length, 8)) {
+                s3m_player_free(ctx);
+                return 0;
             }
+            memcpy(sample->sampledata, mod_sample->data, sample->length);
+
+            if (mod_sample->is_looping)
+                s3m_sample_set_loop(sample, mod_sample->loop_point, mod_sample->loop_point + mod_sample->loop_length);
         }
     }
 
-    /* Allocate space for pattern data */
-    ctx->patterns = malloc(sizeof(struct S3MPattern) * mod->pattern_count);
-    for (i = 0; i < mod->pattern_count; i++) {
-        int r, c, j, note_index;
-        s3m_pattern_init(&ctx->patterns[i]);
-        for (r = 0; r < 64; r++)
-            for (c = 0; c < mod->num_channels; c++) {
-                struct S3MPatternEntry *entry = &ctx->patterns[i].row[r][c];
-                struct ModPatternEntry *modentry = &mod->pattern[i].row[r][c];
-                if (modentry->note_period) {
-                    note_index = -1;
-                    /* find note index in amiga table */
-                    for (j = 0; j < 60; j++)
-                        if (amiga_period_table[j] == modentry->note_period) {
-                            note_index = j;
-                            break;
-                        }
-                    entry->note = (note_index / 12 + 2) << 4 | (note_index % 12);
-                }
-                entry->inst = modentry->instrument;
-                switch (modentry->effect) {
-                case MOD_EFFECT_SET_VOLUME:
-                    entry->vol = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_ARPEGGIO:
-                    if (modentry->effect_data) {
-                        entry->command = ST3_EFFECT_ARPEGGIO;
-                        entry->cominfo = modentry->effect_data;
-                    }
-                    break;
-                case MOD_EFFECT_SET_SPEED:
-                    entry->command = (modentry->effect_data < 0x20) ? ST3_EFFECT_SET_SPEED : ST3_EFFECT_TEMPO;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE:
-                    entry->command = ST3_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_VIBRATO_AND_VOLUME_SLIDE:
-                    entry->command = ST3_EFFECT_VIBRATO_AND_VOLUME_SLIDE;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_PORTAMENTO:
-                    entry->command = ST3_EFFECT_TONE_PORTAMENTO;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_SLIDE_UP:
-                    entry->command = ST3_EFFECT_SLIDE_UP;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_SLIDE_DOWN:
-                    entry->command = ST3_EFFECT_SLIDE_DOWN;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_PATTERN_BREAK:
-                    entry->command = ST3_EFFECT_BREAK_PATTERN;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                case MOD_EFFECT_VOLUME_SLIDE:
-                    entry->command = ST3_EFFECT_VOLUME_SLIDE;
-                    entry->cominfo = modentry->effect_data;
-                    break;
-                default:
-                    break;
-                }
-
-            }
+    ctx->num_channels = mod->num_channels;
+    ctx->master_gain = s3m_master_gain(ctx->num_channels);
+    ctx->enabled_channels = (mod->num_channels < 32) ? (1UL << mod->num_channels) - 1 : 0xFFFFFFFFUL;
+    ctx->pattern_order = malloc(mod->song_length + 1);
+    if (!s3m_pattern_cache_init(ctx, mod_pattern_decode, mod) || ctx->pattern_order == NULL) {
+        s3m_player_free(ctx);
+        return 0;
     }
 
-    /* TODO: We are going to need to copy this */
-    ctx->pattern_order = (unsigned char *)mod->pattern_table;
+    /* MOD order tables have no end marker, so copy the orders up to song
+     * length that name a pattern in the file and terminate the copy. B
+     * targets map to the first copied order at or after them. */
+    for (i = 0, j = 0; i < mod->song_length; i++) {
+        ctx->order_map[i] = j;
+        if (mod->pattern_table[i] < mod->pattern_count && mod->pattern_table[i] != 0xFF)
+            ctx->pattern_order[j++] = mod->pattern_table[i];
+    }
+    for (; i < 256; i++)
+        ctx->order_map[i] = j;
+    ctx->pattern_order[j] = 0xFF;
+    if (j == 0) {
+        s3m_player_free(ctx);
+        return 0;
+    }
     ctx->current_order = 0;
     ctx->current_pattern = ctx->pattern_order[ctx->current_order];
 
@@ -309,66 +543,106 @@ void mod_player_init(struct S3MPlayerContext* ctx, struct Mod* mod, int sample_r
     memset(ctx->channel, 0, sizeof(ctx->channel));
 
 
-    /* TODO: Channels need to be distributed according to channel settings */
-    for (i = 0; i < 16; i++)
-        ctx->sample_stream[i].channel = &ctx->channel[i];
-
     /* Hardcode some default panning values */
-    for (i = 0; i < 8; i++) {
+    for (i = 0; i < 16; i++) {
         ctx->channel[i * 2].panning = 0x03; /* Even channels are left dominant */
         ctx->channel[i * 2 + 1].panning = 0x0C; /* Odd channels are right dominant */
     }
-
-    printf("Current Pattern: %d\n", ctx->current_pattern);
+    return 1;
 }
-void s3m_player_init(struct S3MPlayerContext* ctx, struct S3MFile* file, int sample_rate)
+
+/* Returns 0, with nothing left allocated, if out of memory or no order names a pattern */
+int s3m_player_init(struct S3MPlayerContext* ctx, struct S3MFile* file, int sample_rate)
 {
-    int i;
+    int i, j;
 
     memset(ctx, 0, sizeof(struct S3MPlayerContext));
 
     ctx->sample_rate = sample_rate;
+    ctx->mix_stereo = s3m_mix_select();
+    s3m_mix_init_tables();
 
     /* Default settings */
     ctx->current_row = 0;
     ctx->song_speed = file->header->initial_speed;
     ctx->tick_counter = ctx->song_speed;
     ctx->samples_until_next_tick = 0;
-    ctx->sample_rate = 48000;
+    ctx->global_volume = 64;
     s3m_player_set_tempo(ctx, file->header->initial_tempo);
 
     /* Initialize Samples */
     memset(ctx->sample, 0, sizeof(ctx->sample));
     for (i = 0; i < file->header->instrument_count; i++) {
-        if (file->instruments[i].header->type == 1) {
+        if (file->instruments[i].header && file->instruments[i].header->type == 1) {
             struct S3MSampleInstrument *inst = &file->instruments[i];
             struct Sample *sample = &ctx->sample[i];
-            int j;
+            int is_unsigned = (file->header->file_format_info != 1);
 
-            sample->length = inst->header->length;
             sample->volume = inst->header->default_volume;
             sample->c2_speed = inst->header->c2_speed;
-            sample->sampledata = malloc(sizeof(float) * sample->length);
-
-            /* Convert Sample data to float (0-255) -> (-1.0-1.0) */
-            for (j = 0; j <  sample->length; j++)
-                sample->sampledata[j] = 2.0 * inst->sampledata[j] / 255.0 - 1.0;
 
-            if (inst->header->flags & 1) {
-                ctx->sample[i].loop_begin = inst->header->loop_begin;
-                ctx->sample[i].loop_end = inst->header->loop_end;
+            /* Flag 4 is 16 bit little endian data. For stereo samples (flag 2)
+             * the left channel comes first, so that's what gets played. */
+            if (inst->header->flags & 4) {
+                short* data;
+                if (!s3m_sample_alloc(sample, inst->length, 16)) {
+                    s3m_player_free(ctx);
+                    return 0;
+                }
+                data = sample->sampledata;
+                for (j = 0; j < sample->length; j++) {
+                    unsigned int v = inst->sampledata[j * 2] | inst->sampledata[j * 2 + 1] << 8;
+                    data[j] = (short)((is_unsigned ? v ^ 0x8000 : v) & 0xFFFF);
+                }
+            } else {
+                signed char* data;
+                if (!s3m_sample_alloc(sample, inst->length, 8)) {
+                    s3m_player_free(ctx);
+                    return 0;
+                }
+                data = sample->sampledata;
+                for (j = 0; j < sample->length; j++)
+                    data[j] = (signed char)(is_unsigned ? inst->sampledata[j] ^ 0x80 : inst->sampledata[j]);
             }
+
+            if (inst->header->flags & 1)
+                s3m_sample_set_loop(sample, inst->header->loop_begin, inst->header->loop_end);
         }
     }
 
-    /* Allocate space for pattern data */
-    ctx->patterns = malloc(sizeof(struct S3MPattern) * file->header->pattern_count);
-    for (i = 0; i < file->header->pattern_count; i++) {
-        s3m_pattern_init(&ctx->patterns[i]);
-        s3m_pattern_unpack(&ctx->patterns[i], &file->packed_patterns[i]);
+    /* Patterns are stored up to the last channel that isn't unused (255) */
+    for (i = 32; i > 1 && file->header->channel_settings[i - 1] == 255; i--)
+        ;
+    ctx->num_channels = i;
+    ctx->master_gain = s3m_master_gain(ctx->num_channels);
+
+    /* Settings 0-7 are left and 8-15 right channels; adlib channels (16-31),
+     * disabled (+128) and unused (255) channels aren't played. */
+    for (i = 0; i < ctx->num_channels; i++)
+        if (file->header->channel_settings[i] < 16)
+            ctx->enabled_channels |= 1UL << i;
+    ctx->pattern_order = malloc(file->header->order_count + 1);
+    if (!s3m_pattern_cache_init(ctx, s3m_file_pattern_decode, file) || ctx->pattern_order == NULL) {
+        s3m_player_free(ctx);
+        return 0;
     }
 
-    ctx->pattern_order = file->orders;
+    /* Copy the playable orders: skip "+++" markers (0xFE) and patterns the
+     * file doesn't have, and make sure the list is terminated. B targets
+     * map to the first copied order at or after them. */
+    for (i = 0, j = 0; i < file->header->order_count && file->orders[i] != 0xFF; i++) {
+        if (i < 256)
+            ctx->order_map[i] = j;
+        if (file->orders[i] < file->header->pattern_count)
+            ctx->pattern_order[j++] = file->orders[i];
+    }
+    for (; i < 256; i++)
+        ctx->order_map[i] = j;
+    ctx->pattern_order[j] = 0xFF;
+    if (j == 0) {
+        s3m_player_free(ctx);
+        return 0;
+    }
     ctx->current_order = 0;
     ctx->current_pattern = ctx->pattern_order[ctx->current_order];
 
@@ -376,54 +650,142 @@ void s3m_player_init(struct S3MPlayerContext* ctx, struct S3MFile* file, int sam
     memset(ctx->channel, 0, sizeof(ctx->channel));
 
 
-    /* TODO: Channels need to be distributed according to channel settings */
-    for (i = 0; i < 16; i++)
-        ctx->sample_stream[i].channel = &ctx->channel[i];
+    /* Left channels start at 3 and right channels at 0xC; entries in the
+     * default pan table with bit 5 set override that. */
+    for (i = 0; i < 32; i++) {
+        ctx->channel[i].panning = ((file->header->channel_settings[i] & 0x7F) < 8) ? 0x03 : 0x0C;
+        if (file->default_channel_pan && (file->default_channel_pan[i] & 0x20))
+            ctx->channel[i].panning = file->default_channel_pan[i] & 0x0F;
+    }
+    return 1;
+}
 
-    /* Hardcode some default panning values */
-    for (i = 0; i < 8; i++) {
-        ctx->channel[i * 2].panning = 0x03; /* Even channels are left dominant */
-        ctx->channel[i * 2 + 1].panning = 0x0C; /* Odd channels are right dominant */
+/*
+ * Frees what s3m_player_init or mod_player_init allocated and stops any
+ * mixing threads. The song itself is left to s3m_unload or mod_unload.
+ */
+void s3m_player_free(struct S3MPlayerContext* ctx)
+{
+    struct S3MPattern* patterns = ctx->pattern_cache[0].data;
+    int i;
+
+    s3m_set_mix_threads(ctx, 1);
+    for (i = 0; i < 99; i++) {
+        struct Sample* sample = &ctx->sample[i];
+        if (sample->sampledata)
+            free((char*)sample->sampledata - S3M_SAMPLE_PAD * (sample->bits / 8));
+        sample->sampledata = NULL;
+    }
+    if (patterns) {
+        free(patterns[0].entries);
+        free(patterns[0].events);
+        free(patterns);
     }
+    memset(ctx->pattern_cache, 0, sizeof(ctx->pattern_cache));
+    free(ctx->pattern_order);
+    ctx->pattern_order = NULL;
+}
 
-    printf("Current Pattern: %d\n", ctx->current_pattern);
+static void s3m_sample_stream_set_step(struct S3MSampleStream* ss, int period, int sample_rate)
+{
+    double step = get_note_herz(period) / sample_rate;
+    ss->step = (int)step;
+    ss->step_frac = (unsigned int)((step - ss->step) * 4294967296.0);
+    ss->step_period = period;
 }
 
-void s3m_accumulate_sample_stream(float* buffer, int length, struct S3MSampleStream* ss, int sample_rate)
+/*
+ * Number of frames (up to max_frames) that can be stepped without the
+ * position reaching the loop end or the end of the sample. One frame of
+ * slack absorbs rounding in the division; the frame(s) at the boundary
+ * itself go through the checked path.
+ */
+static int s3m_sample_stream_span(const struct S3MSampleStream* ss, int max_frames)
 {
-    struct S3MChannel* chan = ss->channel;
-    float volume = chan->volume / 64.0;
-    float panning = chan->panning / 15.0;
+    int limit = ss->loop_end ? ss->loop_end : ss->length;
+    double remaining, step, frames;
 
-    if (chan->sample == NULL)
-        return;
+    if (ss->position >= limit)
+        return 0;
 
-    if (volume == 0)
-        return;
+    remaining = (limit - ss->position) - ss->position_frac / 4294967296.0;
+    step = ss->step + ss->step_frac / 4294967296.0;
+    frames = remaining / step - 1;
 
-    ss->sample = chan->sample;
-    ss->sample_step = get_note_herz(chan->period) / sample_rate;
-    if (chan->note_on) {
-        ss->sample_index = chan->effects.sample_offset;
-        chan->note_on = 0;
-    }
+    if (frames <= 0)
+        return 0;
+    return (frames < max_frames) ? (int)frames : max_frames;
+}
+
+void s3m_accumulate_sample_stream(float* buffer, int length, struct S3MSampleStream* ss, struct S3MPlayerContext* ctx)
+{
+    float block[S3M_MIX_BLOCK];
+    int ended = 0;
 
-    while (length--) {
+    if (!ss->playing)
+        return;
+
+    while (length && !ended) {
+        int frames = (length < S3M_MIX_BLOCK) ? length : S3M_MIX_BLOCK;
+        int i = 0;
 
-        ss->sample_index += ss->sample_step;
+        while (i < frames) {
+            int span = s3m_sample_stream_span(ss, frames - i);
 
-        /* If looping is enabled and we've reached the loop end, loop back. */
-        if (ss->sample->loop_end && ss->sample_index >= ss->sample->loop_end)
-            ss->sample_index -= (ss->sample->loop_end - ss->sample->loop_begin);
+            /* Every position in the span is inside the sample, no checks needed */
+            s3m_mix_gather(&block[i], span, ss, ctx->interpolation);
+            i += span;
+            if (i == frames)
+                break;
 
-        if ((int)ss->sample_index < ss->sample->length) {
-            float sample = ss->sample->sampledata[(int)ss->sample_index];
-            *buffer++ += (1.0 - panning) * volume * sample;
-            *buffer++ += panning * volume * sample;
+            /* Boundary frame: add the fraction first; it carried if it got smaller. */
+            ss->position_frac += ss->step_frac;
+            ss->position += ss->step + (ss->position_frac < ss->step_frac);
+
+            /* If looping is enabled and we've reached the loop end, loop back. */
+            if (ss->loop_end && ss->position >= ss->loop_end)
+                ss->position -= (ss->loop_end - ss->loop_begin);
+
+            if (ss->position < ss->length) {
+                block[i++] = s3m_mix_fetch(ss->sample, ss->position, ss->position_frac, ctx->interpolation);
+            } else if (!ss->loop_end) {
+                /* Sample has finished playing, the rest is silence and the
+                 * voice stays quiet until the next note. */
+                for (; i < frames; i++)
+                    block[i] = 0.0f;
+                ss->playing = 0;
+                ended = 1;
+            } else {
+                block[i++] = 0.0f;
+            }
         }
+
+        ctx->mix_stereo(buffer, block, frames, ss->left_gain, ss->right_gain);
+        buffer += frames * 2;
+        length -= frames;
     }
 }
 
+/* Moves a voice on as if it had been mixed, for channels nobody hears */
+void s3m_skip_sample_stream(struct S3MSampleStream* ss, int frames)
+{
+    double frac;
+    int carry;
+
+    if (!ss->playing)
+        return;
+
+    frac = ss->position_frac + (double)ss->step_frac * frames;
+    carry = (int)(frac / 4294967296.0);
+    ss->position_frac = (unsigned int)(frac - carry * 4294967296.0);
+    ss->position += ss->step * frames + carry;
+
+    if (ss->loop_end && ss->position >= ss->loop_end)
+        ss->position = ss->loop_begin + (ss->position - ss->loop_begin) % (ss->loop_end - ss->loop_begin);
+    else if (!ss->loop_end && ss->position >= ss->length)
+        ss->playing = 0;
+}
+
 int s3m_note_offset(int base_note, int offset) {
     int octave = base_note >> 4;
     int note = base_note & 0x0F;
@@ -434,333 +796,767 @@ int s3m_note_offset(int base_note, int offset) {
     return octave << 4 | note;
 }
 
+/* Fine slides happen on the first tick of a row, normal slides on the rest */
+static int s3m_is_first_tick(const struct S3MPlayerContext* ctx)
+{
+    return ctx->tick_counter == ctx->song_speed;
+}
+
+/*
+ * Row handlers read the effect's parameters from the cell into the
+ * channel's effect memory and set current_effect for effects that keep
+ * running on later ticks.
+ */
+
+static void effect_set_speed_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)chan;
+    if (entry->cominfo)
+        ctx->song_speed = entry->cominfo;
+}
+
+static void effect_jump_to_order_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)chan;
+    ctx->jump_order = ctx->order_map[entry->cominfo];
+}
+
+/* The row is given in decimal digits; rows past the end mean the first */
+static void effect_break_pattern_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    int row = (entry->cominfo >> 4) * 10 + (entry->cominfo & 0x0F);
+
+    (void)chan;
+    ctx->jump_row = (row < PATTERN_ROWS) ? row : 0;
+}
+
+/* D, and the volume slide half of K and L */
+static void effect_volume_slide_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    int x = entry->cominfo >> 4;
+    int y = entry->cominfo & 15;
+
+    (void)ctx;
+    if (entry->cominfo) {
+        if (y && (x == 0 || x == 15)) {
+            chan->effects.volume_slide_speed = -y;
+            chan->effects.is_fine_slide = (x == 15);
+        }
+        else if (x && (y == 0 || y == 15)) {
+            chan->effects.volume_slide_speed = x;
+            chan->effects.is_fine_slide = (y == 15);
+        }
+    }
+    chan->current_effect = entry->command;
+}
+
+/* E and F */
+static void effect_pitch_slide_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    int x = entry->cominfo >> 4;
+    int y = entry->cominfo & 15;
+
+    (void)ctx;
+    if (entry->cominfo) {
+        if (x == 15) {
+            chan->effects.pitch_slide_type = 1;
+            chan->effects.pitch_slide_speed = y;
+        }
+        else if (x == 14) {
+            chan->effects.pitch_slide_type = 2;
+            chan->effects.pitch_slide_speed = y;
+        }
+        else {
+            chan->effects.pitch_slide_type = 0;
+            chan->effects.pitch_slide_speed = entry->cominfo;
+        }
+    }
+    chan->current_effect = entry->command;
+}
+
+static void effect_tone_portamento_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)ctx;
+    if (entry->cominfo)
+        chan->effects.portamento_speed = entry->cominfo;
+
+    chan->current_effect = ST3_EFFECT_TONE_PORTAMENTO;
+}
+
+static void effect_vibrato_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    int x = entry->cominfo >> 4;
+    int y = entry->cominfo & 15;
+
+    (void)ctx;
+    if (x)
+        chan->effects.vibrato.speed = x;
+    if (y)
+        chan->effects.vibrato.depth = y;
+
+    chan->current_effect = ST3_EFFECT_VIBRATO;
+}
+
+static void effect_tremolo_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    int x = entry->cominfo >> 4;
+    int y = entry->cominfo & 15;
+
+    (void)ctx;
+    if (x)
+        chan->effects.tremolo.speed = x;
+    if (y)
+        chan->effects.tremolo.depth = y;
+
+    chan->current_effect = ST3_EFFECT_TREMOLO;
+}
+
+static void effect_arpeggio_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)ctx;
+    if (entry->note != 255 && entry->note != 254)
+        chan->effects.arpeggio_notes[0] = entry->note;
+
+    if (entry->cominfo) {
+        int base_note = chan->effects.arpeggio_notes[0];
+        chan->effects.arpeggio_notes[1] = s3m_note_offset(base_note, entry->cominfo >> 4);
+        chan->effects.arpeggio_notes[2] = s3m_note_offset(base_note, entry->cominfo & 15);
+        chan->effects.arpeggio_index = 0;
+    }
+    chan->current_effect = ST3_EFFECT_ARPEGGIO;
+}
+
+static void effect_sample_offset_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)ctx;
+    chan->effects.sample_offset = entry->cominfo * 256;
+}
+
+static void effect_retrig_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)ctx;
+    if (entry->cominfo) {
+        chan->effects.retrig_volume_modifier = entry->cominfo >> 4;
+        chan->effects.retrig_frequency = entry->cominfo & 15;
+    }
+    chan->effects.retrig_counter = 0;
+    chan->current_effect = ST3_EFFECT_RETRIG;
+}
+
+static void effect_tempo_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    (void)chan;
+    s3m_player_set_tempo(ctx, entry->cominfo);
+}
+
+static void effect_special_row(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry)
+{
+    int y = entry->cominfo & 15;
+
+    (void)ctx;
+    /* TODO: Figure out how to really handle these special commands */
+    switch (entry->cominfo >> 4) {
+    case 0x03:
+        chan->effects.vibrato.waveform = y & 7;
+        break;
+    case 0x04:
+        chan->effects.tremolo.waveform = y & 7;
+        break;
+    case 0x08:
+    case 0x0A:
+        chan->panning = y;
+        break;
+    case 0x0D:
+        chan->effects.retrig_delay = y;
+        chan->note_on = 0;
+        break;
+    }
+    chan->current_effect = ST3_EFFECT_SPECIAL;
+}
+
+/* Tick handlers run on every tick of the row, including the first */
+
+static void effect_volume_slide_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    int perform_slide = 0;
+
+    if (s3m_is_first_tick(ctx))
+        perform_slide = chan->effects.is_fine_slide;
+    else
+        perform_slide = !chan->effects.is_fine_slide;
+
+    if (perform_slide) {
+        chan->volume += chan->effects.volume_slide_speed;
+        if (chan->volume > 64) chan->volume = 64;
+        if (chan->volume < 0) chan->volume = 0;
+    }
+}
+
+static void effect_vibrato_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    if (!s3m_is_first_tick(ctx)) {
+        int s = s3m_waveform(chan->effects.vibrato.waveform, chan->effects.vibrato.position);
+        int delta = (chan->effects.vibrato.depth * s) >> 5;
+        chan->period = chan->effects.vibrato.old_period +  delta;
+        chan->effects.vibrato.position += chan->effects.vibrato.speed * 4;
+    }
+}
+
+/* Modulates the volume around the one saved when the effect started */
+static void effect_tremolo_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    if (!s3m_is_first_tick(ctx)) {
+        int s = s3m_waveform(chan->effects.tremolo.waveform, chan->effects.tremolo.position);
+        int volume = chan->effects.tremolo.old_volume + ((chan->effects.tremolo.depth * s) >> 6);
+        chan->volume = (volume < 0) ? 0 : (volume > 64) ? 64 : volume;
+        chan->effects.tremolo.position += chan->effects.tremolo.speed * 4;
+    }
+}
+
+/* Direction is -1 for slide up (shorter period), 1 for slide down */
+static void effect_pitch_slide(struct S3MPlayerContext* ctx, struct S3MChannel* chan, int direction)
+{
+    if (chan->effects.pitch_slide_type) {
+        if (s3m_is_first_tick(ctx)) {
+            int factor = (chan->effects.pitch_slide_type == 2) ? 1 : 4;
+            chan->period += direction * chan->effects.pitch_slide_speed * factor;
+        }
+    }
+    else if (!s3m_is_first_tick(ctx))
+        chan->period += direction * chan->effects.pitch_slide_speed * 4;
+}
+
+static void effect_slide_down_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    effect_pitch_slide(ctx, chan, 1);
+}
+
+static void effect_slide_up_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    effect_pitch_slide(ctx, chan, -1);
+}
+
+static void effect_tone_portamento_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    if (!s3m_is_first_tick(ctx)) {
+        if (chan->period < chan->effects.portamento_target) {
+            chan->period += chan->effects.portamento_speed * 4;
+            if (chan->period > chan->effects.portamento_target)
+                chan->period = chan->effects.portamento_target;
+        }
+        else if (chan->period > chan->effects.portamento_target) {
+            chan->period -= chan->effects.portamento_speed * 4;
+            if (chan->period < chan->effects.portamento_target)
+                chan->period = chan->effects.portamento_target;
+        }
+    }
+}
+
+static void effect_vibrato_volume_slide_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    effect_volume_slide_tick(ctx, chan);
+    effect_vibrato_tick(ctx, chan);
+}
+
+static void effect_portamento_volume_slide_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    effect_volume_slide_tick(ctx, chan);
+    effect_tone_portamento_tick(ctx, chan);
+}
+
+static void effect_retrig_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    (void)ctx;
+    if (chan->effects.retrig_counter++ == chan->effects.retrig_frequency) {
+        chan->note_on = 1;
+        chan->effects.retrig_counter = 0;
+
+        switch (chan->effects.retrig_volume_modifier) {
+            case 1:
+                chan->volume -= 1;
+                break;
+            case 2:
+                chan->volume -= 2;
+                break;
+            case 3:
+                chan->volume -= 4;
+                break;
+            case 4:
+                chan->volume -= 8;
+                break;
+            case 5:
+                chan->volume -= 16;
+                break;
+            case 6:
+                chan->volume = 2 * chan->volume / 3;
+                break;
+            case 7:
+                chan->volume = chan->volume / 2;
+                break;
+            case 9:
+                chan->volume += 1;
+                break;
+            case 10:
+                chan->volume += 2;
+                break;
+            case 11:
+                chan->volume += 4;
+                break;
+            case 12:
+                chan->volume += 8;
+                break;
+            case 13:
+                chan->volume += 16;
+                break;
+            case 14:
+                chan->volume = 3 * chan->volume / 2;
+                break;
+            case 15:
+                chan->volume = chan->volume * 2;
+                break;
+            default:
+                break;
+        }
+    }
+    if (chan->volume > 64) chan->volume = 64;
+    if (chan->volume < 0) chan->volume = 0;
+}
+
+static void effect_special_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    (void)ctx;
+    /* TODO: Generalize note triggering. */
+    if (chan->effects.retrig_delay-- == 0)
+        chan->note_on = 1;
+}
+
+static void effect_arpeggio_tick(struct S3MPlayerContext* ctx, struct S3MChannel* chan)
+{
+    (void)ctx;
+    if (chan->sample && chan->sample->sampledata) {
+        int c2_speed = chan->sample->c2_speed;
+        int arp_note = chan->effects.arpeggio_notes[chan->effects.arpeggio_index];
+        chan->period = get_note_st3period(arp_note, c2_speed);
+        chan->effects.arpeggio_index = (chan->effects.arpeggio_index + 1) % 3;
+    }
+}
+
+typedef void (*S3MEffectRowFunc)(struct S3MPlayerContext* ctx, struct S3MChannel* chan, const struct S3MPatternEntry* entry);
+typedef void (*S3MEffectTickFunc)(struct S3MPlayerContext* ctx, struct S3MChannel* chan);
+
+/* Handlers by effect command, NULL where an effect has nothing to do */
+static const struct {
+    S3MEffectRowFunc row;
+    S3MEffectTickFunc tick;
+} effect_handlers[ST3_EFFECT_GLOBAL_VOLUME + 1] = {
+    { NULL, NULL }, /* . */
+    { effect_set_speed_row, NULL }, /* A */
+    { effect_jump_to_order_row, NULL }, /* B */
+    { effect_break_pattern_row, NULL }, /* C */
+    { effect_volume_slide_row, effect_volume_slide_tick }, /* D */
+    { effect_pitch_slide_row, effect_slide_down_tick }, /* E */
+    { effect_pitch_slide_row, effect_slide_up_tick }, /* F */
+    { effect_tone_portamento_row, effect_tone_portamento_tick }, /* G */
+    { effect_vibrato_row, effect_vibrato_tick }, /* H */
+    { NULL, NULL }, /* I */
+    { effect_arpeggio_row, effect_arpeggio_tick }, /* J */
+    { effect_volume_slide_row, effect_vibrato_volume_slide_tick }, /* K */
+    { effect_volume_slide_row, effect_portamento_volume_slide_tick }, /* L */
+    { NULL, NULL },
+    { NULL, NULL },
+    { effect_sample_offset_row, NULL }, /* O */
+    { NULL, NULL },
+    { effect_retrig_row, effect_retrig_tick }, /* Q */
+    { effect_tremolo_row, effect_tremolo_tick }, /* R */
+    { effect_special_row, effect_special_tick }, /* S */
+    { effect_tempo_row, NULL }, /* T */
+    { NULL, NULL }, /* U */
+    { NULL, NULL } /* V */
+};
+
+/* Tells the listener, if any, about the row about to play */
+static void s3m_publish_row(struct S3MPlayerContext* ctx, struct S3MPattern* pattern)
+{
+    struct S3MEvent* event;
+
+    if (ctx->current_row == 0 && (event = s3m_event_reserve(ctx->events)) != NULL) {
+        event->type = S3M_EVENT_ORDER;
+        event->order = ctx->current_order;
+        event->pattern = ctx->current_pattern;
+        event->row = 0;
+        event->loop_count = ctx->loop_count;
+        event->channels = 0;
+        s3m_event_publish(ctx->events);
+    }
+    if ((event = s3m_event_reserve(ctx->events)) != NULL) {
+        event->type = S3M_EVENT_ROW;
+        event->order = ctx->current_order;
+        event->pattern = ctx->current_pattern;
+        event->row = ctx->current_row;
+        event->loop_count = ctx->loop_count;
+        event->channels = pattern->channels;
+        memcpy(event->cells, s3m_pattern_row(pattern, ctx->current_row),
+            sizeof(struct S3MPatternEntry) * pattern->channels);
+        s3m_event_publish(ctx->events);
+    }
+}
+
 void s3m_process_tick(struct S3MPlayerContext* ctx)
 {
-    int c, x, y, last_row = 64;
+    unsigned long mask, touched = 0;
+    int c;
+
+    if (ctx->stats_enabled) {
+        ctx->stats.ticks++;
+        if (ctx->tick_counter == 0)
+            ctx->stats.rows++;
+    }
 
     if (ctx->tick_counter == 0) {
-        print_row(&ctx->patterns[ctx->current_pattern], ctx->current_row);
-        for (c = 0; c < 16; c++) {
+        struct S3MPattern* pattern = s3m_get_pattern(ctx, ctx->current_pattern);
+        const struct S3MRowEvent* event = &pattern->events[pattern->row_events[ctx->current_row]];
+        const struct S3MRowEvent* row_end = &pattern->events[pattern->row_events[ctx->current_row + 1]];
+        unsigned long idle = ctx->effect_channels & ~pattern->row_channels[ctx->current_row];
+
+        touched = ctx->effect_channels | pattern->row_channels[ctx->current_row];
+        ctx->jump_order = -1;
+        ctx->jump_row = -1;
+        if (ctx->events)
+            s3m_publish_row(ctx, pattern);
+
+        /* Channels without an event only need last row's effect ended */
+        for (c = 0; idle; c++, idle >>= 1) {
+            if (!(idle & 1))
+                continue;
+            if (ctx->channel[c].current_effect == ST3_EFFECT_VIBRATO)
+                ctx->channel[c].period = ctx->channel[c].effects.vibrato.old_period;
+            if (ctx->channel[c].current_effect == ST3_EFFECT_TREMOLO)
+                ctx->channel[c].volume = ctx->channel[c].effects.tremolo.old_volume;
+            ctx->channel[c].current_effect = 0;
+            ctx->channel[c].effects.sample_offset = 0;
+            ctx->effect_channels &= ~(1UL << c);
+        }
+
+        for (; event < row_end; event++) {
 
-            struct S3MPatternEntry* entry = &ctx->patterns[ctx->current_pattern].row[ctx->current_row][c];
+            const struct S3MPatternEntry* entry = &event->cell;
+            struct S3MChannel* chan = &ctx->channel[event->channel];
+
+            /* Tremolo restarts from the unmodulated volume every row */
+            if (chan->current_effect == ST3_EFFECT_TREMOLO)
+                chan->volume = chan->effects.tremolo.old_volume;
 
             if (entry->note != 0xFF && entry->note != 0xFE) {
                 if (entry->inst) {
-                    ctx->channel[c].sample = &ctx->sample[entry->inst - 1];
-                    ctx->channel[c].volume = (entry->vol == 0xFF)
-                        ? ctx->channel[c].sample->volume
+                    chan->sample = &ctx->sample[entry->inst - 1];
+                    chan->volume = (entry->vol == 0xFF)
+                        ? chan->sample->volume
                         : entry->vol;
                 }
-                if (ctx->channel[c].sample->sampledata != NULL) {
+                if (chan->sample && chan->sample->sampledata != NULL) {
                     if (entry->command == ST3_EFFECT_TONE_PORTAMENTO) {
-                        ctx->channel[c].effects.portamento_target = get_note_st3period(entry->note, ctx->channel[c].sample->c2_speed);
+                        chan->effects.portamento_target = get_note_st3period(entry->note, chan->sample->c2_speed);
                     } else {
-                        ctx->channel[c].effects.vibrato.position = 0;
-                        ctx->channel[c].period = get_note_st3period(entry->note, ctx->channel[c].sample->c2_speed);
-                        ctx->channel[c].effects.portamento_target = ctx->channel[c].period;
-                        ctx->channel[c].effects.vibrato.old_period = ctx->channel[c].period;
-                        ctx->channel[c].note_on = 1;
+                        if (!(chan->effects.vibrato.waveform & 4))
+                            chan->effects.vibrato.position = 0;
+                        if (!(chan->effects.tremolo.waveform & 4))
+                            chan->effects.tremolo.position = 0;
+                        chan->period = get_note_st3period(entry->note, chan->sample->c2_speed);
+                        chan->effects.portamento_target = chan->period;
+                        chan->effects.vibrato.old_period = chan->period;
+                        chan->note_on = 1;
                     }
                 }
             } else {
 
                 if (entry->note == 0xFF && entry->inst) {
-                    ctx->channel[c].sample = &ctx->sample[entry->inst - 1];
-                    ctx->channel[c].volume = (entry->vol == 0xFF)
-                        ? ctx->channel[c].sample->volume
+                    chan->sample = &ctx->sample[entry->inst - 1];
+                    chan->volume = (entry->vol == 0xFF)
+                        ? chan->sample->volume
                         : entry->vol;
 
                 }
 
                 if (entry->vol != 0xFF)
-                    ctx->channel[c].volume = entry->vol;
+                    chan->volume = entry->vol;
 
                 if (entry->note == 0xFE)
                     /* Cheap note cut by setting volume to 0. */
-                    ctx->channel[c].volume = 0;
+                    chan->volume = 0;
             }
 
 
-            if (ctx->channel[c].current_effect != ST3_EFFECT_VIBRATO
+            if (chan->current_effect != ST3_EFFECT_VIBRATO
                 && entry->command == ST3_EFFECT_VIBRATO) {
-                ctx->channel[c].effects.vibrato.old_period = ctx->channel[c].period;
+                chan->effects.vibrato.old_period = chan->period;
             }
 
-            if (ctx->channel[c].current_effect == ST3_EFFECT_VIBRATO
+            if (chan->current_effect == ST3_EFFECT_VIBRATO
                 && entry->command != ST3_EFFECT_VIBRATO) {
-                ctx->channel[c].period = ctx->channel[c].effects.vibrato.old_period;
+                chan->period = chan->effects.vibrato.old_period;
             }
 
-            ctx->channel[c].current_effect = 0;
-            ctx->channel[c].effects.sample_offset = 0;
+            if (entry->command == ST3_EFFECT_TREMOLO)
+                chan->effects.tremolo.old_volume = chan->volume;
 
-            x = entry->cominfo >> 4;
-            y = entry->cominfo & 15;
-            switch (entry->command) {
-            case ST3_EFFECT_SET_SPEED:
-                if (entry->cominfo)
-                    ctx->song_speed = entry->cominfo;
-                break;
-            case ST3_EFFECT_BREAK_PATTERN:
-                last_row = ctx->current_row + 1;
-                break;
-            case ST3_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE:
-            case ST3_EFFECT_VIBRATO_AND_VOLUME_SLIDE:
-            case ST3_EFFECT_VOLUME_SLIDE:
-                if (entry->cominfo) {
-                    if (y && (x == 0 || x == 15)) {
-                        ctx->channel[c].effects.volume_slide_speed = -y;
-                        ctx->channel[c].effects.is_fine_slide = (x == 15);
-                    }
-                    else if (x && (y == 0 || y == 15)) {
-                        ctx->channel[c].effects.volume_slide_speed = x;
-                        ctx->channel[c].effects.is_fine_slide = (y == 15);
-                    }
-                }
-                ctx->channel[c].current_effect = entry->command;
-                break;
-            case ST3_EFFECT_SLIDE_DOWN: /* E */
-            case ST3_EFFECT_SLIDE_UP: /* F */
-                if (entry->cominfo) {
-                    if (x == 15) {
-                        ctx->channel[c].effects.pitch_slide_type = 1;
-                        ctx->channel[c].effects.pitch_slide_speed = y;
-                    }
-                    else if (x == 14) {
-                        ctx->channel[c].effects.pitch_slide_type = 2;
-                        ctx->channel[c].effects.pitch_slide_speed = y;
-                    }
-                    else {
-                        ctx->channel[c].effects.pitch_slide_type = 0;
-                        ctx->channel[c].effects.pitch_slide_speed = entry->cominfo;
-                    }
-                }
-                ctx->channel[c].current_effect = entry->command;
-                break;
-            case ST3_EFFECT_TONE_PORTAMENTO:
-                if (entry->cominfo)
-                    ctx->channel[c].effects.portamento_speed = entry->cominfo;
-
-                ctx->channel[c].current_effect = ST3_EFFECT_TONE_PORTAMENTO;
-                break;
-            case ST3_EFFECT_VIBRATO:
-                if (x)
-                    ctx->channel[c].effects.vibrato.speed = x;
-                if (y)
-                    ctx->channel[c].effects.vibrato.depth = y;
-
-                ctx->channel[c].current_effect = ST3_EFFECT_VIBRATO;
-                break;
-            case ST3_EFFECT_ARPEGGIO:
+            chan->current_effect = 0;
+            chan->effects.sample_offset = 0;
 
-                if (entry->note != 255 && entry->note != 254)
-                    ctx->channel[c].effects.arpeggio_notes[0] = entry->note;
-
-                if (entry->cominfo) {
-                    int base_note = ctx->channel[c].effects.arpeggio_notes[0];
-                    ctx->channel[c].effects.arpeggio_notes[1] = s3m_note_offset(base_note, x);
-                    ctx->channel[c].effects.arpeggio_notes[2] = s3m_note_offset(base_note, y);
-                    ctx->channel[c].effects.arpeggio_index = 0;
-                }
-                ctx->channel[c].current_effect = ST3_EFFECT_ARPEGGIO;
-                break;
-            case ST3_EFFECT_SET_SAMPLE_OFFSET:
-                ctx->channel[c].effects.sample_offset = entry->cominfo * 256;
-                break;
-            case ST3_EFFECT_RETRIG:
-                if (entry->cominfo) {
-                    ctx->channel[c].effects.retrig_volume_modifier = x;
-                    ctx->channel[c].effects.retrig_frequency = y;
-                }
-                ctx->channel[c].effects.retrig_counter = 0;
-                ctx->channel[c].current_effect = ST3_EFFECT_RETRIG;
-                break;
-            case ST3_EFFECT_TEMPO:
-                s3m_player_set_tempo(ctx, entry->cominfo);
-                break;
-            case ST3_EFFECT_SPECIAL:
-                /* TODO: Figure out how to really handle these special commands */
-                switch (x) {
-                case 0x08:
-                case 0x0A:
-                    ctx->channel[c].panning = y;
-                    break;
-                case 0x0D:
-                    ctx->channel[c].effects.retrig_delay = y;
-                    ctx->channel[c].note_on = 0;
-                    break;
-                }
-                ctx->channel[c].current_effect = ST3_EFFECT_SPECIAL;
-                break;
-            default:
-                break;
-            }
+            if (entry->command <= ST3_EFFECT_GLOBAL_VOLUME && effect_handlers[entry->command].row)
+                effect_handlers[entry->command].row(ctx, chan, entry);
 
+            if (chan->current_effect || chan->effects.sample_offset)
+                ctx->effect_channels |= 1UL << event->channel;
+            else
+                ctx->effect_channels &= ~(1UL << event->channel);
         }
         ctx->current_row++;
-        if (ctx->current_row == last_row) {
-            ctx->current_order++;
-            /* If we've reached the last order repeat song */
-            if (ctx->pattern_order[ctx->current_order] == 0xFF)
-                ctx->current_order = 0;
+        if (ctx->jump_order >= 0 || ctx->jump_row >= 0 || ctx->current_row == PATTERN_ROWS) {
+            int order = (ctx->jump_order >= 0) ? ctx->jump_order : ctx->current_order + 1;
 
+            /* Going past the last order or jumping back repeats the song */
+            if (ctx->pattern_order[order] == 0xFF)
+                order = 0;
+            if (order <= ctx->current_order)
+                ctx->loop_count++;
+
+            ctx->current_order = order;
             ctx->current_pattern = ctx->pattern_order[ctx->current_order];
-            printf("Current Pattern: %d\n", ctx->current_pattern);
-            ctx->current_row = 0;
+            ctx->current_row = (ctx->jump_row >= 0) ? ctx->jump_row : 0;
         }
         ctx->tick_counter = ctx->song_speed;
     }
 
-    for (c = 0; c < 16; c++) {
-        if (ctx->channel[c].current_effect == ST3_EFFECT_VOLUME_SLIDE
-            || ctx->channel[c].current_effect == ST3_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE
-            || ctx->channel[c].current_effect == ST3_EFFECT_VIBRATO_AND_VOLUME_SLIDE) {
-            int perform_slide = 0;
-
-            if (ctx->tick_counter == ctx->song_speed)
-                perform_slide = ctx->channel[c].effects.is_fine_slide;
-            else
-                perform_slide = !ctx->channel[c].effects.is_fine_slide;
-
-            if (perform_slide) {
-                ctx->channel[c].volume += ctx->channel[c].effects.volume_slide_speed;
-                if (ctx->channel[c].volume > 64) ctx->channel[c].volume = 64;
-                if (ctx->channel[c].volume < 0) ctx->channel[c].volume = 0;
-            }
-        }
-        if (ctx->channel[c].current_effect == ST3_EFFECT_VIBRATO
-            || ctx->channel[c].current_effect == ST3_EFFECT_VIBRATO_AND_VOLUME_SLIDE) {
-            if (ctx->tick_counter != ctx->song_speed) {
-                int s = 64 * sin(2 * M_PI * ((ctx->channel[c].effects.vibrato.position & 0xFF) / 255.0));
-                int delta = (4 * ctx->channel[c].effects.vibrato.depth * s) >> 5;
-                ctx->channel[c].period = ctx->channel[c].effects.vibrato.old_period +  delta;
-                ctx->channel[c].effects.vibrato.position += ctx->channel[c].effects.vibrato.speed * 4;
-            }
-        }
+    /* Only channels with an effect running have per-tick work */
+    for (c = 0, mask = ctx->effect_channels; mask; c++, mask >>= 1) {
+        struct S3MChannel* chan = &ctx->channel[c];
 
-        if (ctx->channel[c].current_effect == ST3_EFFECT_SLIDE_UP) {
-            if (ctx->channel[c].effects.pitch_slide_type) {
-                if (ctx->tick_counter == ctx->song_speed) {
-                    int factor = (ctx->channel[c].effects.pitch_slide_type == 2) ? 1 : 4;
-                    ctx->channel[c].period -= ctx->channel[c].effects.pitch_slide_speed * factor;
-                }
-            }
-            else if (ctx->tick_counter != ctx->song_speed)
-                ctx->channel[c].period -= ctx->channel[c].effects.pitch_slide_speed * 4;
-        }
-        if (ctx->channel[c].current_effect == ST3_EFFECT_SLIDE_DOWN) {
-            if (ctx->channel[c].effects.pitch_slide_type) {
-                if (ctx->tick_counter == ctx->song_speed) {
-                    int factor = (ctx->channel[c].effects.pitch_slide_type == 2) ? 1 : 4;
-                    ctx->channel[c].period += ctx->channel[c].effects.pitch_slide_speed * factor;
-                }
-            }
-            else if (ctx->tick_counter != ctx->song_speed)
-                ctx->channel[c].period += ctx->channel[c].effects.pitch_slide_speed * 4;
-        }
-        if (ctx->channel[c].current_effect == ST3_EFFECT_TONE_PORTAMENTO
-            || ctx->channel[c].current_effect == ST3_EFFECT_PORTAMENTO_AND_VOLUME_SLIDE) {
-            if (ctx->tick_counter != ctx->song_speed) {
-               if (ctx->channel[c].period < ctx->channel[c].effects.portamento_target) {
-                   ctx->channel[c].period += ctx->channel[c].effects.portamento_speed * 4;
-                   if (ctx->channel[c].period > ctx->channel[c].effects.portamento_target)
-                       ctx->channel[c].period = ctx->channel[c].effects.portamento_target;
-               }
-               else if (ctx->channel[c].period > ctx->channel[c].effects.portamento_target) {
-                   ctx->channel[c].period -= ctx->channel[c].effects.portamento_speed * 4;
-                   if (ctx->channel[c].period < ctx->channel[c].effects.portamento_target)
-                       ctx->channel[c].period = ctx->channel[c].effects.portamento_target;
-               }
-            }
-        }
-        if (ctx->channel[c].current_effect == ST3_EFFECT_RETRIG) {
-            if (ctx->channel[c].effects.retrig_counter++ == ctx->channel[c].effects.retrig_frequency) {
-                ctx->channel[c].note_on = 1;
-                ctx->channel[c].effects.retrig_counter = 0;
-
-                switch (ctx->channel[c].effects.retrig_volume_modifier) {
-                    case 1:
-                        ctx->channel[c].volume -= 1;
-                        break;
-                    case 2:
-                        ctx->channel[c].volume -= 2;
-                        break;
-                    case 3:
-                        ctx->channel[c].volume -= 4;
-                        break;
-                    case 4:
-                        ctx->channel[c].volume -= 8;
-                        break;
-                    case 5:
-                        ctx->channel[c].volume -= 16;
-                        break;
-                    case 6:
-                        ctx->channel[c].volume = 2 * ctx->channel[c].volume / 3;
-                        break;
-                    case 7:
-                        ctx->channel[c].volume = ctx->channel[c].volume / 2;
-                        break;
-                    case 9:
-                        ctx->channel[c].volume += 1;
-                        break;
-                    case 10:
-                        ctx->channel[c].volume += 2;
-                        break;
-                    case 11:
-                        ctx->channel[c].volume += 4;
-                        break;
-                    case 12:
-                        ctx->channel[c].volume += 8;
-                        break;
-                    case 13:
-                        ctx->channel[c].volume += 16;
-                        break;
-                    case 14:
-                        ctx->channel[c].volume = 3 * ctx->channel[c].volume / 2;
-                        break;
-                    case 15:
-                        ctx->channel[c].volume = ctx->channel[c].volume * 2;
-                        break;
-                    default:
-                        break;
-                }
-            }
-            if (ctx->channel[c].volume > 64) ctx->channel[c].volume = 64;
-            if (ctx->channel[c].volume < 0) ctx->channel[c].volume = 0;
-        }
-        if (ctx->channel[c].current_effect == ST3_EFFECT_SPECIAL) {
-            /* TODO: Generalize note triggering. */
-            if (ctx->channel[c].effects.retrig_delay-- == 0)
-                ctx->channel[c].note_on = 1;
-        }
-        if (ctx->channel[c].current_effect == ST3_EFFECT_ARPEGGIO) {
-            if (ctx->channel[c].sample->sampledata) {
-                int c2_speed = ctx->channel[c].sample->c2_speed;
-                int arp_note = ctx->channel[c].effects.arpeggio_notes[ctx->channel[c].effects.arpeggio_index];
-                ctx->channel[c].period = get_note_st3period(arp_note, c2_speed);
-                ctx->channel[c].effects.arpeggio_index = (ctx->channel[c].effects.arpeggio_index + 1) % 3;
-            }
-        }
+        if ((mask & 1) && effect_handlers[chan->current_effect].tick)
+            effect_handlers[chan->current_effect].tick(ctx, chan);
+    }
 
-        if(ctx->period_limits.min && ctx->period_limits.max) {
+    /* Periods only change on channels with an event or an effect */
+    if (ctx->period_limits.min && ctx->period_limits.max) {
+        for (c = 0, mask = touched | ctx->effect_channels; mask; c++, mask >>= 1) {
+            if (!(mask & 1))
+                continue;
             if (ctx->channel[c].period > ctx->period_limits.max)
                 ctx->channel[c].period = ctx->period_limits.max;
             if (ctx->channel[c].period < ctx->period_limits.min)
                 ctx->channel[c].period = ctx->period_limits.min;
         }
-
     }
     ctx->tick_counter--;
 }
 
-void s3m_render_audio(float* buffer, int samples_remaining, struct S3MPlayerContext* ctx)
+/*
+ * Volume, period and note triggers only change on ticks, so once per tick
+ * the voices that can make sound get their mixer state refreshed from
+ * their channels and are listed for the mixer. A note waiting on a channel
+ * with no volume isn't triggered until the volume comes back.
+ */
+void s3m_update_voices(struct S3MPlayerContext* ctx)
+{
+    unsigned long mask;
+    int c;
+
+    ctx->active_voice_count = 0;
+    for (c = 0, mask = ctx->enabled_channels; mask; c++, mask >>= 1) {
+        struct S3MChannel* chan = &ctx->channel[c];
+        struct S3MSampleStream* ss = &ctx->sample_stream[c];
+        float volume, panning;
+
+        if (!(mask & 1)
+            || !(chan->note_on || ss->playing)
+            || !chan->sample || !chan->sample->sampledata
+            || chan->period <= 0 || chan->volume <= 0)
+            continue;
+
+        ss->sample = chan->sample;
+        ss->length = chan->sample->length;
+        ss->loop_begin = chan->sample->loop_begin;
+        ss->loop_end = chan->sample->loop_end;
+        if (chan->period != ss->step_period)
+            s3m_sample_stream_set_step(ss, chan->period, ctx->sample_rate);
+        if (chan->note_on) {
+            ss->position = chan->effects.sample_offset;
+            ss->position_frac = 0;
+            ss->playing = 1;
+            chan->note_on = 0;
+        }
+
+        /* Samples are gathered as raw integers; scale them to -1.0..1.0 here */
+        volume = chan->volume / 64.0f * (ctx->global_volume / 64.0f) * ctx->master_gain;
+        volume *= (ss->sample->bits == 16) ? 1.0f / 32768.0f : 1.0f / 128.0f;
+        panning = chan->panning / 15.0f;
+        ss->left_gain = (1.0f - panning) * volume;
+        ss->right_gain = panning * volume;
+
+        ctx->active_voices[ctx->active_voice_count++] = c;
+    }
+}
+
+/* Monotonic clock for the stats, only read while they are enabled */
+static double s3m_clock_ns(void)
+{
+    return s3m_wall_seconds() * 1e9;
+}
+
+/*
+ * Queues a command for the render thread. Only one thread may send to a
+ * player. Returns 0 if the queue is full.
+ */
+int s3m_send_command(struct S3MPlayerContext* ctx, enum S3MCommandType type, int target, int value)
+{
+    struct S3MCommandQueue* queue = &ctx->commands;
+    struct S3MCommand* command;
+
+    if (queue->head - s3m_load_acquire(&queue->tail) == S3M_COMMAND_QUEUE_SIZE)
+        return 0;
+    command = &queue->commands[queue->head & (S3M_COMMAND_QUEUE_SIZE - 1)];
+    command->type = type;
+    command->target = target;
+    command->value = value;
+    s3m_store_release(&queue->head, queue->head + 1);
+    return 1;
+}
+
+static void s3m_apply_command(struct S3MPlayerContext* ctx, const struct S3MCommand* command)
 {
+    unsigned long channel_bit = (command->target >= 0 && command->target < 32)
+        ? 1UL << command->target
+        : 0;
+    int c, orders;
+
+    switch (command->type) {
+    case S3M_COMMAND_JUMP:
+        for (orders = 0; ctx->pattern_order[orders] != 0xFF; orders++)
+            ;
+        if (command->target < 0 || command->target >= orders || command->value < 0 || command->value >= PATTERN_ROWS)
+            break;
+        ctx->current_order = command->target;
+        ctx->current_pattern = ctx->pattern_order[ctx->current_order];
+        ctx->current_row = command->value;
+        ctx->tick_counter = 0; /* The next tick plays the row */
+        break;
+    case S3M_COMMAND_MUTE:
+        if (command->value)
+            ctx->muted_channels |= channel_bit;
+        else
+            ctx->muted_channels &= ~channel_bit;
+        break;
+    case S3M_COMMAND_SOLO:
+        if (command->value)
+            ctx->solo_channels |= channel_bit;
+        else
+            ctx->solo_channels &= ~channel_bit;
+        break;
+    case S3M_COMMAND_GLOBAL_VOLUME:
+        if (command->value >= 0 && command->value <= 64)
+            ctx->global_volume = command->value;
+        break;
+    case S3M_COMMAND_TEMPO:
+        s3m_player_set_tempo(ctx, command->value);
+        break;
+    case S3M_COMMAND_SPEED:
+        if (command->value > 0)
+            ctx->song_speed = command->value;
+        break;
+    case S3M_COMMAND_PAUSE:
+        ctx->paused = command->value != 0;
+        break;
+    case S3M_COMMAND_SEEK:
+        if (ctx->seek_index && command->value >= 0)
+            s3m_seek(ctx, ctx->seek_index, (unsigned long)((double)command->value * ctx->sample_rate / 1000));
+        break;
+    case S3M_COMMAND_STOP:
+        for (c = 0; c < 32; c++) {
+            ctx->channel[c].note_on = 0;
+            ctx->sample_stream[c].playing = 0;
+        }
+        ctx->active_voice_count = 0;
+        ctx->stopped = 1;
+        break;
+    }
+}
+
+/* Applies what other threads have sent since the last tick */
+static void s3m_apply_commands(struct S3MPlayerContext* ctx)
+{
+    struct S3MCommandQueue* queue = &ctx->commands;
+    unsigned int head = s3m_load_acquire(&queue->head);
+    unsigned int tail = queue->tail;
+
+    if (tail == head)
+        return;
+    for (; tail != head; tail++)
+        s3m_apply_command(ctx, &queue->commands[tail & (S3M_COMMAND_QUEUE_SIZE - 1)]);
+    s3m_store_release(&queue->tail, tail);
+}
+
+void s3m_enable_stats(struct S3MPlayerContext* ctx, int enable)
+{
+    ctx->stats_enabled = enable;
+}
+
+void s3m_get_stats(const struct S3MPlayerContext* ctx, struct S3MStats* stats)
+{
+    *stats = ctx->stats;
+}
+
+void s3m_reset_stats(struct S3MPlayerContext* ctx)
+{
+    memset(&ctx->stats, 0, sizeof(ctx->stats));
+}
+
+/*
+ * Fills buffer with samples_remaining stereo frames. Returns the frames
+ * that came from the song, which is fewer only when stop_at_song_end is
+ * set and the song ended part way; the rest of the buffer is silence.
+ */
+int s3m_render_audio(float* buffer, int samples_remaining, struct S3MPlayerContext* ctx)
+{
+    double callback_start = 0, tick_ns = 0;
+    int frames_played = samples_remaining;
+
+    if (ctx->stats_enabled)
+        callback_start = s3m_clock_ns();
+    if (ctx->mix_pool)
+        s3m_mix_pool_set_rendering(ctx->mix_pool, 1);
+
     while (samples_remaining) {
+        unsigned long audible;
         int samples_to_render;
         int i;
         if (ctx->samples_until_next_tick == 0) {
+            s3m_apply_commands(ctx);
+            /* The order list has wrapped and the next tick plays its first row again */
+            if (ctx->stop_at_song_end && ctx->loop_count > 0 && ctx->tick_counter == 0)
+                ctx->song_ended = 1;
+            if (ctx->song_ended) {
+                memset(buffer, 0, sizeof(float) * samples_remaining * 2);
+                frames_played -= samples_remaining;
+                break;
+            }
+            if (ctx->paused || ctx->stopped) {
+                memset(buffer, 0, sizeof(float) * samples_remaining * 2);
+                break;
+            }
+        }
+        /* A seek can land part way through a tick */
+        if (ctx->samples_until_next_tick == 0) {
+            double tick_start = 0;
+            if (ctx->stats_enabled)
+                tick_start = s3m_clock_ns();
             s3m_process_tick(ctx);
+            s3m_update_voices(ctx);
             ctx->samples_until_next_tick = ctx->samples_per_tick;
+            if (ctx->stats_enabled) {
+                double elapsed = s3m_clock_ns() - tick_start;
+                tick_ns += elapsed;
+                if (elapsed > ctx->stats.max_tick_ns)
+                    ctx->stats.max_tick_ns = elapsed;
+            }
         }
 
         samples_to_render = (samples_remaining > ctx->samples_until_next_tick)
@@ -772,12 +1568,39 @@ void s3m_render_audio(float* buffer, int samples_remaining, struct S3MPlayerCont
 
         memset(buffer, 0, sizeof(float) * samples_to_render * 2);
 
-        for (i = 0; i < 16; i++)
-            s3m_accumulate_sample_stream(buffer, samples_to_render, &ctx->sample_stream[i], ctx->sample_rate);
-
-        for (i = 0; i < samples_to_render * 2; i++)
-            buffer[i] /= 8.0;
+        audible = ctx->solo_channels ? ctx->solo_channels : ~0UL;
+        audible &= ~ctx->muted_channels;
+        if (ctx->mix_pool && ctx->active_voice_count >= 2 * S3M_MIX_POOL_MIN_GROUP) {
+            s3m_mix_pool_render(ctx->mix_pool, buffer, samples_to_render, audible);
+        } else {
+            for (i = 0; i < ctx->active_voice_count; i++) {
+                int c = ctx->active_voices[i];
+                if (audible & (1UL << c))
+                    s3m_accumulate_sample_stream(buffer, samples_to_render, &ctx->sample_stream[c], ctx);
+                else
+                    s3m_skip_sample_stream(&ctx->sample_stream[c], samples_to_render);
+            }
+        }
 
         buffer += samples_to_render * 2;
+
+        if (ctx->stats_enabled) {
+            ctx->stats.chunks++;
+            ctx->stats.voices_mixed += ctx->active_voice_count;
+            ctx->stats.frames += samples_to_render;
+            ctx->stats.voice_frames += (unsigned long)samples_to_render * ctx->active_voice_count;
+        }
+    }
+
+    if (ctx->stats_enabled) {
+        double elapsed = s3m_clock_ns() - callback_start;
+        ctx->stats.callbacks++;
+        ctx->stats.tick_ns += tick_ns;
+        ctx->stats.mix_ns += elapsed - tick_ns;
+        if (elapsed > ctx->stats.max_callback_ns)
+            ctx->stats.max_callback_ns = elapsed;
     }
+    if (ctx->mix_pool)
+        s3m_mix_pool_set_rendering(ctx->mix_pool, 0);
+    return frames_played;
 }
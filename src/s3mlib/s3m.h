@@ -75,7 +75,7 @@ struct S3MModuleHeader {
 struct S3MSampleHeader {
     unsigned char type;
     char dos_filename[12];
-    char null_terminator;
+    unsigned char sample_data_parapointer_hi; /* MemSeg bits 16-23 */
     unsigned short sample_data_parapointer;
     int length;
     int loop_begin;
@@ -101,12 +101,15 @@ struct S3MPackedPattern {
 };
 
 struct S3MSampleInstrument {
-    struct S3MSampleHeader* header;
+    struct S3MSampleHeader* header; /* NULL for an empty slot */
     unsigned char* sampledata;
+    int length; /* Frames actually present in the file */
 };
 
 struct S3MFile {
     unsigned char* file_data;
+    long file_size;
+    int is_mapped; /* file_data is a memory mapping rather than malloc'd */
     struct S3MModuleHeader* header;
     unsigned char* orders;
     struct S3MSampleInstrument instruments[99];
@@ -122,8 +125,22 @@ struct S3MPatternEntry {
     unsigned char cominfo; /* 00=Continue Last */
 };
 
+/* A cell of a compiled pattern row that has something to do */
+struct S3MRowEvent {
+    int channel;
+    struct S3MPatternEntry cell; /* inst is 0 or a valid instrument */
+};
+
+/*
+ * Decoded pattern: 64 rows of the song's channel count, row-major, and the
+ * non-empty cells of the played channels compiled into a per-row event list.
+ */
 struct S3MPattern {
-    struct S3MPatternEntry row[64][32];
+    int channels; /* Entries per row */
+    struct S3MPatternEntry* entries;
+    struct S3MRowEvent* events;
+    int row_events[65]; /* Row r is events[row_events[r]] to events[row_events[r + 1]] */
+    unsigned long row_channels[64]; /* Bit per channel with an event in the row */
 };
 
 struct S3MChannel {
@@ -139,7 +156,15 @@ struct S3MChannel {
             int position;
             int depth;
             int speed;
+            int waveform; /* S3x: 0-3 = sine, ramp, square, random; +4 = don't retrigger */
         } vibrato;
+        struct {
+            int old_volume;
+            int position;
+            int depth;
+            int speed;
+            int waveform; /* S4x, as for vibrato */
+        } tremolo;
         int portamento_speed;
         int portamento_target;
         int volume_slide_speed;
@@ -156,8 +181,18 @@ struct S3MChannel {
     } effects;
 };
 
+/*
+ * Sample data is kept as signed 8 or 16 bit frames (the mixer converts to
+ * float) and stored with S3M_SAMPLE_PAD guard frames on either side so
+ * interpolators can read a few frames around the position without bounds
+ * checks. Guard frames after loop_end repeat the start of the loop; those
+ * after the end of a one-shot sample (and before frame 0) are silence.
+ */
+#define S3M_SAMPLE_PAD 8
+
 struct Sample {
-    float* sampledata;
+    void* sampledata; /* Frame 0, S3M_SAMPLE_PAD frames into the allocation */
+    int bits; /* 8 or 16 */
     int length;
     int loop_begin;
     int loop_end;
@@ -165,13 +200,148 @@ struct Sample {
     int volume;
 };
 
+/*
+ * Mixer state of one voice: everything the mix loop reads, kept apart
+ * from the channel's effect memory so mixing streams through
+ * sample_stream[] alone. s3m_update_voices refreshes it after each tick.
+ *
+ * Resampler position and step are 32.32 fixed point: a whole frame index
+ * plus a fraction in units of 1/2^32 frame (unsigned int is 32 bits on
+ * every platform we target).
+ */
 struct S3MSampleStream {
-    struct Sample* sample;
-    struct S3MChannel* channel;
-    float sample_index;
-    float sample_step;
+    const struct Sample* sample;
+    int position;
+    unsigned int position_frac;
+    int step;
+    unsigned int step_frac;
+    int length;
+    int loop_begin;
+    int loop_end; /* 0 if the sample doesn't loop */
+    float left_gain; /* Volume, panning and the sample's integer scale */
+    float right_gain;
+    int playing; /* From note on until a one-shot sample runs out */
+    int step_period; /* Period the step was computed for */
 };
 
+typedef void (*S3MMixFunc)(float*, const float*, int, float, float);
+
+/* Patterns are decoded when playback first reaches them and kept in a
+ * small least-recently-used cache. */
+#define S3M_PATTERN_CACHE_SIZE 4
+
+struct S3MPlayerContext;
+typedef void (*S3MPatternDecodeFunc)(struct S3MPlayerContext*, struct S3MPattern*, int);
+
+enum S3MInterpolation {
+    S3M_INTERPOLATION_NEAREST = 0,
+    S3M_INTERPOLATION_LINEAR,
+    S3M_INTERPOLATION_CUBIC, /* 4 tap Catmull-Rom */
+    S3M_INTERPOLATION_SINC /* 8 tap Lanczos windowed sinc */
+};
+
+/*
+ * Counters kept by the player while stats are enabled (s3m_enable_stats).
+ * Durations are monotonic wall clock nanoseconds. Nothing synchronises
+ * them with rendering, so read them between s3m_render_audio calls or
+ * accept a partially updated set.
+ */
+struct S3MStats {
+    unsigned long ticks;
+    unsigned long rows;
+    unsigned long callbacks; /* s3m_render_audio calls */
+    unsigned long chunks; /* Spans mixed between tick boundaries */
+    unsigned long voices_mixed; /* Active voices, summed over chunks */
+    unsigned long frames; /* Output frames rendered */
+    unsigned long voice_frames; /* Frames mixed, summed over voices */
+    double tick_ns; /* Spent in s3m_process_tick and s3m_update_voices */
+    double mix_ns; /* The rest of s3m_render_audio */
+    double max_tick_ns;
+    double max_callback_ns; /* Longest single s3m_render_audio call */
+};
+
+/*
+ * Control from other threads: commands go through a single-producer,
+ * single-consumer queue and take effect at the next tick boundary.
+ */
+enum S3MCommandType {
+    S3M_COMMAND_JUMP, /* target: order, value: row */
+    S3M_COMMAND_MUTE, /* target: channel, value: 1 to mute, 0 to unmute */
+    S3M_COMMAND_SOLO, /* target: channel, value: 1 to solo, 0 to unsolo */
+    S3M_COMMAND_GLOBAL_VOLUME, /* value: 0-64 */
+    S3M_COMMAND_TEMPO, /* value: beats per minute */
+    S3M_COMMAND_SPEED, /* value: ticks per row */
+    S3M_COMMAND_PAUSE, /* value: 1 to pause, 0 to resume */
+    S3M_COMMAND_STOP, /* Cuts every voice; the output stays silent */
+    S3M_COMMAND_SEEK /* value: milliseconds from the start, needs seek_index */
+};
+
+struct S3MCommand {
+    enum S3MCommandType type;
+    int target;
+    int value;
+};
+
+#define S3M_COMMAND_QUEUE_SIZE 32 /* Must be a power of two */
+
+/* head is only written by the sending thread, tail by the render thread */
+struct S3MCommandQueue {
+    unsigned int head;
+    unsigned int tail;
+    struct S3MCommand commands[S3M_COMMAND_QUEUE_SIZE];
+};
+
+/*
+ * Seeking: a scan of the song without mixing records where every row
+ * starts and, every few rows, a snapshot of the player state. A seek
+ * restores the nearest snapshot before the target and plays on from
+ * there without mixing.
+ */
+struct S3MRowTime {
+    unsigned long frame; /* Output frames from the start of the song */
+    int order;
+    int row;
+};
+
+struct S3MSnapshot {
+    unsigned long frame;
+    int order;
+    int row;
+    int tick_counter;
+    int tempo;
+    int speed;
+    int samples_per_tick;
+    unsigned long effect_channels;
+};
+
+#define S3M_SNAPSHOT_ROWS 16 /* Default rows between snapshots */
+
+struct S3MSeekIndex {
+    int sample_rate;
+    int channels; /* Channel and voice states kept per snapshot */
+    unsigned long length; /* Frames until the song loops */
+    int row_count;
+    struct S3MRowTime* rows;
+    int snapshot_count;
+    struct S3MSnapshot* snapshots;
+    struct S3MChannel* channel_state; /* channels per snapshot */
+    struct S3MSampleStream* voice_state;
+};
+
+/* What s3m_simulate finds out about a song without playing it */
+struct S3MSongInfo {
+    unsigned long length; /* Frames until playback returns to a row it played */
+    int loops; /* 0 if the scan gave up first */
+    int loop_order; /* The row it returns to */
+    int loop_row;
+    unsigned long loop_start; /* Frame at which that row first played */
+    int rows; /* Rows played before looping */
+    int ticks;
+};
+
+struct S3MEventRing;
+struct S3MMixPool;
+
 struct S3MPlayerContext {
     int song_tempo;
     int song_speed;
@@ -181,13 +351,22 @@ struct S3MPlayerContext {
     int samples_until_next_tick;
     int sample_rate;
 
+    int num_channels; /* Pattern columns the song uses */
+    float master_gain; /* Mixing headroom for num_channels voices */
+    unsigned long enabled_channels; /* Bit per channel that is played */
+    unsigned long effect_channels; /* Bit per channel with row effect state to reset */
+    int jump_order; /* Set by B while a row plays, -1 if it has none */
+    int jump_row; /* Set by C while a row plays, -1 if it has none */
     unsigned char* pattern_order;
-    struct S3MPattern* patterns;
+    unsigned char order_map[256]; /* File order to the pattern_order entry B goes to */
     int current_order;
     int current_pattern;
+    int loop_count; /* Times playback has gone back to an earlier order */
 
     struct S3MChannel channel[32];
-    struct S3MSampleStream sample_stream[16];
+    struct S3MSampleStream sample_stream[32];
+    int active_voices[32]; /* Channels the mixer visits, rebuilt every tick */
+    int active_voice_count;
     struct Sample sample[99];
 
     struct {
@@ -195,13 +374,62 @@ struct S3MPlayerContext {
         int min;
     } period_limits;
 
+    struct {
+        int pattern; /* -1 when the slot is empty */
+        unsigned int last_used;
+        struct S3MPattern* data;
+    } pattern_cache[S3M_PATTERN_CACHE_SIZE];
+    unsigned int pattern_cache_clock;
+    S3MPatternDecodeFunc decode_pattern;
+    const void* song; /* S3MFile or Mod the patterns are decoded from */
+
+    S3MMixFunc mix_stereo; /* Selected at init for the running CPU */
+    enum S3MInterpolation interpolation; /* Defaults to nearest */
+    struct S3MMixPool* mix_pool; /* Set by s3m_set_mix_threads, NULL mixes serially */
+
+    struct S3MEventRing* events; /* Row and order events go here if set */
+
+    struct S3MCommandQueue commands; /* Filled by s3m_send_command */
+    const struct S3MSeekIndex* seek_index; /* For S3M_COMMAND_SEEK */
+    unsigned long muted_channels;
+    unsigned long solo_channels; /* When any are set only these are heard */
+    int global_volume; /* 0-64 */
+    int paused;
+    int stopped;
+    int stop_at_song_end; /* Go silent instead of looping, see song_ended */
+    int song_ended; /* Set at the tick boundary where the song would restart */
+
+    int stats_enabled; /* Off by default; the counters cost a clock read per tick */
+    struct S3MStats stats;
+
 };
 
 struct Mod;
 
 extern int s3m_load(struct S3MFile*, const char*);
-extern void s3m_render_audio(float*, int, struct S3MPlayerContext*);
-extern void s3m_player_init(struct S3MPlayerContext*, struct S3MFile*, int);
-extern void mod_player_init(struct S3MPlayerContext*, struct Mod*, int);
+extern void s3m_unload(struct S3MFile*);
+extern int s3m_render_audio(float*, int, struct S3MPlayerContext*);
+extern void s3m_process_tick(struct S3MPlayerContext*);
+extern void s3m_update_voices(struct S3MPlayerContext*);
+extern void s3m_accumulate_sample_stream(float*, int, struct S3MSampleStream*, struct S3MPlayerContext*);
+extern void s3m_skip_sample_stream(struct S3MSampleStream*, int);
+extern int s3m_player_init(struct S3MPlayerContext*, struct S3MFile*, int);
+extern int mod_player_init(struct S3MPlayerContext*, struct Mod*, int);
+extern void s3m_player_free(struct S3MPlayerContext*);
+extern int s3m_set_mix_threads(struct S3MPlayerContext*, int);
+extern struct S3MPattern* s3m_get_pattern(struct S3MPlayerContext*, int);
+extern void s3m_pattern_init(struct S3MPattern*);
+extern void s3m_pattern_unpack(struct S3MPattern*, struct S3MPackedPattern*);
+extern void s3m_enable_stats(struct S3MPlayerContext*, int);
+extern void s3m_get_stats(const struct S3MPlayerContext*, struct S3MStats*);
+extern void s3m_reset_stats(struct S3MPlayerContext*);
+extern void s3m_format_pattern_entry(char*, const struct S3MPatternEntry*);
+extern int s3m_send_command(struct S3MPlayerContext*, enum S3MCommandType, int, int);
+extern void s3m_skip_audio(struct S3MPlayerContext*, unsigned long);
+extern int s3m_seek_index_build(struct S3MPlayerContext*, struct S3MSeekIndex*, int);
+extern void s3m_seek_index_free(struct S3MSeekIndex*);
+extern const struct S3MRowTime* s3m_seek_index_row(const struct S3MSeekIndex*, unsigned long);
+extern void s3m_seek(struct S3MPlayerContext*, const struct S3MSeekIndex*, unsigned long);
+extern int s3m_simulate(struct S3MPlayerContext*, struct S3MSongInfo*);
 
 #endif
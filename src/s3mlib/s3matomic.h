@@ -0,0 +1,33 @@
+#ifndef _S3MATOMIC_H_
+#define _S3MATOMIC_H_
+
+/*
+ * Acquire loads and release stores of an unsigned int shared between two
+ * threads. Enough to hand data from one thread to another through a ring
+ * buffer: everything written before a release store is visible to a
+ * thread that sees the stored value through an acquire load.
+ *
+ * s3m_fetch_add returns the old value, and s3m_compare_exchange stores
+ * desired only if the value is still expected, returning nonzero if it
+ * did; both are full barriers and safe with any number of threads.
+ */
+#if defined(__GNUC__) || defined(__clang__)
+#define s3m_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define s3m_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define s3m_fetch_add(p, v) __atomic_fetch_add((p), (v), __ATOMIC_SEQ_CST)
+#define s3m_compare_exchange(p, expected, desired) \
+    __sync_bool_compare_and_swap((p), (expected), (desired))
+#elif defined(_MSC_VER)
+#include <intrin.h>
+/* MSVC gives volatile accesses acquire and release semantics (/volatile:ms) */
+#define s3m_load_acquire(p) (*(volatile unsigned int*)(p))
+#define s3m_store_release(p, v) (*(volatile unsigned int*)(p) = (v))
+#define s3m_fetch_add(p, v) \
+    ((unsigned int)_InterlockedExchangeAdd((volatile long*)(p), (long)(v)))
+#define s3m_compare_exchange(p, expected, desired) \
+    (_InterlockedCompareExchange((volatile long*)(p), (long)(desired), (long)(expected)) == (long)(expected))
+#else
+#error "No atomic load/store for this compiler"
+#endif
+
+#endif
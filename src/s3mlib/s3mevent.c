@@ -0,0 +1,34 @@
+#include "s3mevent.h"
+#include "s3matomic.h"
+#include <string.h>
+
+void s3m_event_ring_init(struct S3MEventRing* ring)
+{
+    memset(ring, 0, sizeof(struct S3MEventRing));
+}
+
+struct S3MEvent* s3m_event_reserve(struct S3MEventRing* ring)
+{
+    /* Only this thread writes head, so it can be read plainly */
+    if (ring->head - s3m_load_acquire(&ring->tail) == S3M_EVENT_RING_SIZE) {
+        ring->dropped++;
+        return NULL;
+    }
+    return &ring->events[ring->head & (S3M_EVENT_RING_SIZE - 1)];
+}
+
+void s3m_event_publish(struct S3MEventRing* ring)
+{
+    s3m_store_release(&ring->head, ring->head + 1);
+}
+
+int s3m_event_pop(struct S3MEventRing* ring, struct S3MEvent* event)
+{
+    unsigned int tail = ring->tail;
+
+    if (s3m_load_acquire(&ring->head) == tail)
+        return 0;
+    *event = ring->events[tail & (S3M_EVENT_RING_SIZE - 1)];
+    s3m_store_release(&ring->tail, tail + 1);
+    return 1;
+}
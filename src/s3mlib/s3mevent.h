@@ -0,0 +1,51 @@
+#ifndef _S3MEVENT_H_
+#define _S3MEVENT_H_
+
+#include "s3m.h"
+
+/*
+ * Playback events published by the player to one listener on another
+ * thread, typically a display. Publishing never blocks, allocates or
+ * makes a system call, so it is safe from an audio callback; when the
+ * listener falls behind, new events are dropped and counted.
+ */
+
+#define S3M_EVENT_RING_SIZE 64 /* Must be a power of two */
+
+enum S3MEventType {
+    S3M_EVENT_ORDER, /* Playback moved on to a new order */
+    S3M_EVENT_ROW /* A row is about to play */
+};
+
+struct S3MEvent {
+    enum S3MEventType type;
+    int order;
+    int pattern;
+    int row;
+    int loop_count;
+    int channels; /* Cells filled in, rows only */
+    struct S3MPatternEntry cells[32];
+};
+
+/*
+ * head and tail count events ever published and consumed; the producer
+ * only writes head and the consumer only writes tail.
+ */
+struct S3MEventRing {
+    unsigned int head;
+    unsigned int tail;
+    unsigned int dropped; /* Written by the producer */
+    struct S3MEvent events[S3M_EVENT_RING_SIZE];
+};
+
+extern void s3m_event_ring_init(struct S3MEventRing*);
+
+/* Producer: a free slot to fill in, or NULL (counted as dropped) if full */
+extern struct S3MEvent* s3m_event_reserve(struct S3MEventRing*);
+/* Producer: makes the slot from s3m_event_reserve visible to the consumer */
+extern void s3m_event_publish(struct S3MEventRing*);
+
+/* Consumer: copies out the oldest event; returns 0 if there is none */
+extern int s3m_event_pop(struct S3MEventRing*, struct S3MEvent*);
+
+#endif
@@ -1,12 +1,22 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include "s3m.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 static int _s3m_file_is_valid(struct S3MFile* s3m)
 {
 
-    if (s3m->header->type == 16
+    if (s3m->file_size >= (long)sizeof(struct S3MModuleHeader)
+        && s3m->header->type == 16
         && memcmp(s3m->header->SCRM, "SCRM", 4) == 0) {
         return 1;
     }
@@ -15,53 +25,139 @@ static int _s3m_file_is_valid(struct S3MFile* s3m)
     return 0;
 }
 
-static int _s3m_load(struct S3MFile* s3m, FILE* fp)
+static unsigned int read_le16(const unsigned char* p)
 {
-    long filesize;
+    return p[0] | p[1] << 8;
+}
 
-    fseek(fp, 0, SEEK_END);
-    filesize = ftell(fp);
-    rewind(fp);
+/* True if [offset, offset + length) lies inside the file */
+static int _s3m_in_file(struct S3MFile* s3m, long offset, long length)
+{
+    return offset >= 0 && length >= 0 && offset <= s3m->file_size - length;
+}
 
-    /* Dump entire file's contents into memory,
-     * because it's the 21st century. */
-    s3m->file_data = malloc(filesize);
-    if (fread(s3m->file_data, 1, filesize, fp)) {
-        unsigned short* parapointers;
-        int i;
+/*
+ * Sets up the header, order, instrument and pattern pointers into file_data.
+ * Every parapointer is checked against the file size; a zero parapointer
+ * is an empty instrument or pattern. Sample data cut short by the end of
+ * the file is truncated.
+ */
+static int _s3m_parse(struct S3MFile* s3m)
+{
+    unsigned char* parapointers;
+    int i;
 
-        s3m->header = (struct S3MModuleHeader*)s3m->file_data;
-        s3m->orders = &s3m->file_data[0x60];
+    s3m->header = (struct S3MModuleHeader*)s3m->file_data;
+    s3m->orders = &s3m->file_data[0x60];
+
+    if (!_s3m_file_is_valid(s3m))
+        return 0;
 
-        if (!_s3m_file_is_valid(s3m)) {
-            fprintf(stderr, "S3M File is invalid\n");
-            free(s3m->file_data);
+    if (s3m->header->order_count < 0
+        || s3m->header->instrument_count < 0 || s3m->header->instrument_count > 99
+        || s3m->header->pattern_count < 0 || s3m->header->pattern_count > 100) {
+        fprintf(stderr, "S3M header counts out of range\n");
+        return 0;
+    }
+    if (!_s3m_in_file(s3m, 0x60, s3m->header->order_count
+            + s3m->header->instrument_count * 2
+            + s3m->header->pattern_count * 2)) {
+        fprintf(stderr, "S3M parapointer tables truncated\n");
+        return 0;
+    }
+
+    /* Setup instrument pointers */
+    parapointers = &s3m->file_data[0x60 + s3m->header->order_count];
+    for (i = 0; i < s3m->header->instrument_count; i++) {
+        struct S3MSampleInstrument* inst = &s3m->instruments[i];
+        long offset = read_le16(&parapointers[i * 2]) * 16L;
+        long sample_offset, frame_size;
+
+        inst->header = NULL;
+        inst->sampledata = NULL;
+        inst->length = 0;
+        if (offset == 0)
+            continue;
+        if (!_s3m_in_file(s3m, offset, sizeof(struct S3MSampleHeader))) {
+            fprintf(stderr, "S3M instrument %d out of bounds\n", i + 1);
             return 0;
         }
+        inst->header = (struct S3MSampleHeader*)&s3m->file_data[offset];
+        if (inst->header->type != 1)
+            continue;
 
-        /* Setup instrument pointers */
-        parapointers = (unsigned short*)&s3m->file_data[0x60 + s3m->header->order_count];
-        for (i = 0; i < s3m->header->instrument_count; i++) {
-            struct S3MSampleInstrument* inst = &s3m->instruments[i];
-            inst->header = (struct S3MSampleHeader*)&s3m->file_data[parapointers[i] * 16];
-            inst->sampledata = (unsigned char*)&s3m->file_data[inst->header->sample_data_parapointer * 16];
+        /* Sample data parapointer is 24 bits, high byte first */
+        sample_offset = ((long)inst->header->sample_data_parapointer_hi << 16
+            | inst->header->sample_data_parapointer) * 16;
+        if (!_s3m_in_file(s3m, sample_offset, 0) || inst->header->length < 0) {
+            fprintf(stderr, "S3M sample %d out of bounds\n", i + 1);
+            inst->header = NULL;
+            continue;
         }
+        frame_size = (inst->header->flags & 4) ? 2 : 1;
+        inst->sampledata = &s3m->file_data[sample_offset];
+        inst->length = inst->header->length;
+        if (!_s3m_in_file(s3m, sample_offset, inst->length * frame_size))
+            inst->length = (s3m->file_size - sample_offset) / frame_size;
+    }
 
-        parapointers = (unsigned short*)&s3m->file_data[0x60
-            + s3m->header->order_count
-            + s3m->header->instrument_count * 2];
-        for (i = 0; i < s3m->header->pattern_count; i++) {
-            unsigned short* packed_length = (unsigned short*)&s3m->file_data[parapointers[i] * 16];
-            s3m->packed_patterns[i].length = *packed_length;
-            /* Packed data begins 2 bytes after length (WORD) */
-            s3m->packed_patterns[i].data = (unsigned char*)&packed_length[1];
+    parapointers = &s3m->file_data[0x60
+        + s3m->header->order_count
+        + s3m->header->instrument_count * 2];
+    for (i = 0; i < s3m->header->pattern_count; i++) {
+        long offset = read_le16(&parapointers[i * 2]) * 16L;
+        long length;
+
+        s3m->packed_patterns[i].length = 0;
+        s3m->packed_patterns[i].data = NULL;
+        if (offset == 0)
+            continue;
+        if (!_s3m_in_file(s3m, offset, 2)) {
+            fprintf(stderr, "S3M pattern %d out of bounds\n", i);
+            return 0;
         }
+        /* Packed data begins 2 bytes after length (WORD) */
+        length = read_le16(&s3m->file_data[offset]);
+        if (!_s3m_in_file(s3m, offset + 2, length))
+            length = s3m->file_size - (offset + 2);
+        s3m->packed_patterns[i].length = length;
+        s3m->packed_patterns[i].data = &s3m->file_data[offset + 2];
+    }
 
-        printf("S3M Load Complete\n");
-        return 1;
+    /* Default pan positions follow the parapointers when d.p is 252 */
+    s3m->default_channel_pan = NULL;
+    if (s3m->header->default_pan == 252) {
+        long offset = 0x60 + s3m->header->order_count
+            + s3m->header->instrument_count * 2
+            + s3m->header->pattern_count * 2;
+        if (_s3m_in_file(s3m, offset, 32))
+            s3m->default_channel_pan = &s3m->file_data[offset];
+    }
+
+    return 1;
+}
+
+#ifdef _WIN32
+
+static int _s3m_load(struct S3MFile* s3m, FILE* fp)
+{
+    long filesize;
+
+    fseek(fp, 0, SEEK_END);
+    filesize = ftell(fp);
+    rewind(fp);
+
+    s3m->file_data = malloc(filesize);
+    s3m->file_size = filesize;
+    s3m->is_mapped = 0;
+    if (s3m->file_data && fread(s3m->file_data, 1, filesize, fp) == (size_t)filesize) {
+        if (_s3m_parse(s3m))
+            return 1;
+    } else {
+        fprintf(stderr, "Error loading file\n");
     }
-    fprintf(stderr, "Error loading file\n");
     free(s3m->file_data);
+    s3m->file_data = NULL;
     return 0;
 }
 
@@ -79,3 +175,57 @@ int s3m_load(struct S3MFile* s3m, const char* filename)
     fclose(fp);
     return status;
 }
+
+#else
+
+/*
+ * The file is mapped read-only and S3MFile points straight into the
+ * mapping, so pages are only read as the player touches them.
+ */
+int s3m_load(struct S3MFile* s3m, const char* filename)
+{
+    struct stat st;
+    void* mapping;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Can't open file: %s\n", filename);
+        return 0;
+    }
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Error loading file\n");
+        close(fd);
+        return 0;
+    }
+    mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        fprintf(stderr, "Error loading file\n");
+        return 0;
+    }
+
+    s3m->file_data = mapping;
+    s3m->file_size = st.st_size;
+    s3m->is_mapped = 1;
+    if (!_s3m_parse(s3m)) {
+        s3m_unload(s3m);
+        return 0;
+    }
+    return 1;
+}
+
+#endif
+
+void s3m_unload(struct S3MFile* s3m)
+{
+    if (s3m->file_data == NULL)
+        return;
+#ifndef _WIN32
+    if (s3m->is_mapped)
+        munmap(s3m->file_data, s3m->file_size);
+    else
+#endif
+        free(s3m->file_data);
+    s3m->file_data = NULL;
+}
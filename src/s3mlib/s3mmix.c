@@ -0,0 +1,265 @@
+#include "s3mmix.h"
+#include "s3matomic.h"
+#include <math.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846264338327950288
+#endif
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define S3M_MIX_X86
+#include <immintrin.h>
+#endif
+
+void s3m_mix_stereo_scalar(float* buffer, const float* mono, int frames, float left_gain, float right_gain)
+{
+    int i;
+    for (i = 0; i < frames; i++) {
+        buffer[i * 2] += mono[i] * left_gain;
+        buffer[i * 2 + 1] += mono[i] * right_gain;
+    }
+}
+
+#ifdef S3M_MIX_X86
+
+/* Four frames per iteration: duplicate each mono sample into an L/R pair,
+ * then scale by the gain pair and accumulate. */
+__attribute__((target("sse2")))
+void s3m_mix_stereo_sse2(float* buffer, const float* mono, int frames, float left_gain, float right_gain)
+{
+    __m128 gains = _mm_setr_ps(left_gain, right_gain, left_gain, right_gain);
+    int i;
+
+    for (i = 0; i + 4 <= frames; i += 4) {
+        __m128 m = _mm_loadu_ps(&mono[i]);
+        __m128 lo = _mm_mul_ps(_mm_unpacklo_ps(m, m), gains);
+        __m128 hi = _mm_mul_ps(_mm_unpackhi_ps(m, m), gains);
+        _mm_storeu_ps(&buffer[i * 2], _mm_add_ps(_mm_loadu_ps(&buffer[i * 2]), lo));
+        _mm_storeu_ps(&buffer[i * 2 + 4], _mm_add_ps(_mm_loadu_ps(&buffer[i * 2 + 4]), hi));
+    }
+    s3m_mix_stereo_scalar(&buffer[i * 2], &mono[i], frames - i, left_gain, right_gain);
+}
+
+/* Eight frames per iteration, same scheme as the SSE2 kernel. */
+__attribute__((target("avx2")))
+void s3m_mix_stereo_avx2(float* buffer, const float* mono, int frames, float left_gain, float right_gain)
+{
+    __m256 gains = _mm256_setr_ps(left_gain, right_gain, left_gain, right_gain,
+        left_gain, right_gain, left_gain, right_gain);
+    __m256i lo_index = _mm256_setr_epi32(0, 0, 1, 1, 2, 2, 3, 3);
+    __m256i hi_index = _mm256_setr_epi32(4, 4, 5, 5, 6, 6, 7, 7);
+    int i;
+
+    for (i = 0; i + 8 <= frames; i += 8) {
+        __m256 m = _mm256_loadu_ps(&mono[i]);
+        __m256 lo = _mm256_mul_ps(_mm256_permutevar8x32_ps(m, lo_index), gains);
+        __m256 hi = _mm256_mul_ps(_mm256_permutevar8x32_ps(m, hi_index), gains);
+        _mm256_storeu_ps(&buffer[i * 2], _mm256_add_ps(_mm256_loadu_ps(&buffer[i * 2]), lo));
+        _mm256_storeu_ps(&buffer[i * 2 + 8], _mm256_add_ps(_mm256_loadu_ps(&buffer[i * 2 + 8]), hi));
+    }
+    s3m_mix_stereo_sse2(&buffer[i * 2], &mono[i], frames - i, left_gain, right_gain);
+}
+
+S3MMixFunc s3m_mix_select(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return s3m_mix_stereo_avx2;
+    if (__builtin_cpu_supports("sse2"))
+        return s3m_mix_stereo_sse2;
+    return s3m_mix_stereo_scalar;
+}
+
+#else
+
+void s3m_mix_stereo_sse2(float* buffer, const float* mono, int frames, float left_gain, float right_gain)
+{
+    s3m_mix_stereo_scalar(buffer, mono, frames, left_gain, right_gain);
+}
+
+void s3m_mix_stereo_avx2(float* buffer, const float* mono, int frames, float left_gain, float right_gain)
+{
+    s3m_mix_stereo_scalar(buffer, mono, frames, left_gain, right_gain);
+}
+
+S3MMixFunc s3m_mix_select(void)
+{
+    return s3m_mix_stereo_scalar;
+}
+
+#endif
+
+/* Catmull-Rom weights for frames p-1, p, p+1, p+2 */
+static float cubic_table[S3M_MIX_PHASES][4];
+/* Lanczos windowed sinc weights for frames p-3 .. p+4 */
+static float sinc_table[S3M_MIX_PHASES][S3M_MIX_SINC_TAPS];
+
+enum {
+    TABLES_EMPTY,
+    TABLES_BUILDING,
+    TABLES_READY
+};
+static unsigned int tables_state = TABLES_EMPTY;
+
+static double sinc(double x)
+{
+    return (x == 0) ? 1.0 : sin(M_PI * x) / (M_PI * x);
+}
+
+void s3m_mix_init_tables(void)
+{
+    int phase, k;
+
+    if (s3m_load_acquire(&tables_state) == TABLES_READY)
+        return;
+    if (!s3m_compare_exchange(&tables_state, TABLES_EMPTY, TABLES_BUILDING)) {
+        /* Another player is building them; it takes well under a millisecond */
+        while (s3m_load_acquire(&tables_state) != TABLES_READY)
+            ;
+        return;
+    }
+
+    for (phase = 0; phase < S3M_MIX_PHASES; phase++) {
+        double t = (double)phase / S3M_MIX_PHASES;
+        double sum = 0;
+
+        cubic_table[phase][0] = (-t * t * t + 2 * t * t - t) / 2;
+        cubic_table[phase][1] = (3 * t * t * t - 5 * t * t + 2) / 2;
+        cubic_table[phase][2] = (-3 * t * t * t + 4 * t * t + t) / 2;
+        cubic_table[phase][3] = (t * t * t - t * t) / 2;
+
+        for (k = 0; k < S3M_MIX_SINC_TAPS; k++) {
+            double x = (k - (S3M_MIX_SINC_TAPS / 2 - 1)) - t;
+            double w = sinc(x) * sinc(x / (S3M_MIX_SINC_TAPS / 2));
+            sinc_table[phase][k] = w;
+            sum += w;
+        }
+        /* Normalise so DC passes at unity gain for every phase */
+        for (k = 0; k < S3M_MIX_SINC_TAPS; k++)
+            sinc_table[phase][k] /= sum;
+    }
+    s3m_store_release(&tables_state, TABLES_READY);
+}
+
+/*
+ * Fetchers return the raw integer sample value as a float; the caller folds
+ * the 8 or 16 bit scale into the channel gains. DEFINE_FETCHERS expands to
+ * one set per storage type.
+ */
+#define DEFINE_FETCHERS(suffix, type) \
+static float fetch_nearest##suffix(const type* data, int position, unsigned int frac) \
+{ \
+    (void)frac; \
+    return data[position]; \
+} \
+\
+static float fetch_linear##suffix(const type* data, int position, unsigned int frac) \
+{ \
+    float t = frac * (1.0f / 4294967296.0f); \
+    return data[position] + (data[position + 1] - data[position]) * t; \
+} \
+\
+static float fetch_cubic##suffix(const type* data, int position, unsigned int frac) \
+{ \
+    const float* w = cubic_table[frac >> (32 - S3M_MIX_PHASE_BITS)]; \
+    const type* p = &data[position - 1]; \
+    return p[0] * w[0] + p[1] * w[1] + p[2] * w[2] + p[3] * w[3]; \
+} \
+\
+static float fetch_sinc##suffix(const type* data, int position, unsigned int frac) \
+{ \
+    const float* w = sinc_table[frac >> (32 - S3M_MIX_PHASE_BITS)]; \
+    const type* p = &data[position - (S3M_MIX_SINC_TAPS / 2 - 1)]; \
+    float sum = 0; \
+    int k; \
+    for (k = 0; k < S3M_MIX_SINC_TAPS; k++) \
+        sum += p[k] * w[k]; \
+    return sum; \
+}
+
+DEFINE_FETCHERS(8, signed char)
+DEFINE_FETCHERS(16, short)
+
+float s3m_mix_fetch(const struct Sample* sample, int position, unsigned int frac, enum S3MInterpolation mode)
+{
+    if (sample->bits == 16) {
+        const short* data = sample->sampledata;
+        switch (mode) {
+        case S3M_INTERPOLATION_LINEAR:
+            return fetch_linear16(data, position, frac);
+        case S3M_INTERPOLATION_CUBIC:
+            return fetch_cubic16(data, position, frac);
+        case S3M_INTERPOLATION_SINC:
+            return fetch_sinc16(data, position, frac);
+        default:
+            return fetch_nearest16(data, position, frac);
+        }
+    } else {
+        const signed char* data = sample->sampledata;
+        switch (mode) {
+        case S3M_INTERPOLATION_LINEAR:
+            return fetch_linear8(data, position, frac);
+        case S3M_INTERPOLATION_CUBIC:
+            return fetch_cubic8(data, position, frac);
+        case S3M_INTERPOLATION_SINC:
+            return fetch_sinc8(data, position, frac);
+        default:
+            return fetch_nearest8(data, position, frac);
+        }
+    }
+}
+
+/* Add the fraction first; it carried if it got smaller. */
+#define GATHER_LOOP(fetch, data) \
+    for (i = 0; i < frames; i++) { \
+        frac += step_frac; \
+        position += step + (frac < step_frac); \
+        block[i] = fetch(data, position, frac); \
+    }
+
+void s3m_mix_gather(float* block, int frames, struct S3MSampleStream* ss, enum S3MInterpolation mode)
+{
+    const signed char* data8 = ss->sample->sampledata;
+    const short* data16 = ss->sample->sampledata;
+    int position = ss->position;
+    unsigned int frac = ss->position_frac;
+    int step = ss->step;
+    unsigned int step_frac = ss->step_frac;
+    int i;
+
+    /* One loop per format and mode so the fetch inlines into it */
+    if (ss->sample->bits == 16) {
+        switch (mode) {
+        case S3M_INTERPOLATION_LINEAR:
+            GATHER_LOOP(fetch_linear16, data16);
+            break;
+        case S3M_INTERPOLATION_CUBIC:
+            GATHER_LOOP(fetch_cubic16, data16);
+            break;
+        case S3M_INTERPOLATION_SINC:
+            GATHER_LOOP(fetch_sinc16, data16);
+            break;
+        default:
+            GATHER_LOOP(fetch_nearest16, data16);
+            break;
+        }
+    } else {
+        switch (mode) {
+        case S3M_INTERPOLATION_LINEAR:
+            GATHER_LOOP(fetch_linear8, data8);
+            break;
+        case S3M_INTERPOLATION_CUBIC:
+            GATHER_LOOP(fetch_cubic8, data8);
+            break;
+        case S3M_INTERPOLATION_SINC:
+            GATHER_LOOP(fetch_sinc8, data8);
+            break;
+        default:
+            GATHER_LOOP(fetch_nearest8, data8);
+            break;
+        }
+    }
+
+    ss->position = position;
+    ss->position_frac = frac;
+}
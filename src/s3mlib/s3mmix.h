@@ -0,0 +1,42 @@
+#ifndef _S3MMIX_H_
+#define _S3MMIX_H_
+
+#include "s3m.h"
+
+/* Fractional positions are looked up in tables with this many phases */
+#define S3M_MIX_PHASE_BITS 8
+#define S3M_MIX_PHASES (1 << S3M_MIX_PHASE_BITS)
+#define S3M_MIX_SINC_TAPS 8
+
+/* Frames gathered per voice before handing them to a mix kernel */
+#define S3M_MIX_BLOCK 64
+
+/*
+ * Mix kernels pan a block of mono voice output into the interleaved stereo
+ * buffer: buffer[2i] += mono[i] * left_gain, buffer[2i+1] += mono[i] * right_gain
+ */
+extern void s3m_mix_stereo_scalar(float*, const float*, int, float, float);
+extern void s3m_mix_stereo_sse2(float*, const float*, int, float, float);
+extern void s3m_mix_stereo_avx2(float*, const float*, int, float, float);
+
+/* Picks the fastest kernel the running CPU supports */
+extern S3MMixFunc s3m_mix_select(void);
+
+/*
+ * Builds the cubic and sinc coefficient tables; safe to call repeatedly
+ * and from several threads at once
+ */
+extern void s3m_mix_init_tables(void);
+
+/*
+ * Steps the stream frames times, writing the interpolated sample at each
+ * new position into block as a raw 8 or 16 bit value. Every position
+ * reached must lie inside the sample (see s3m_sample_stream_span) so no
+ * bounds checks are done.
+ */
+extern void s3m_mix_gather(float* block, int frames, struct S3MSampleStream* ss, enum S3MInterpolation mode);
+
+/* Interpolated raw sample value at a single position */
+extern float s3m_mix_fetch(const struct Sample* sample, int position, unsigned int frac, enum S3MInterpolation mode);
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "s3mmixpool.h"
+#include "s3matomic.h"
+#include "s3mthread.h"
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Workers that see no job for this many yields go to sleep between
+ * checks, unless the player is rendering, so they stay responsive while a
+ * song plays but stop burning a processor once the caller stops asking
+ * for audio.
+ */
+#define SPIN_LIMIT 4096
+
+/*
+ * A job is handed out through one word: its generation above bit 16, its
+ * number of groups in bits 8-15 and the next group to take in bits 0-7.
+ * Taking a group is a compare and exchange on the whole word, so a worker
+ * that wakes up late can never take a group of a job that has moved on.
+ */
+#define TICKET_GENERATION(t) ((t) >> 16)
+#define TICKET_GROUPS(t) (((t) >> 8) & 0xFF)
+#define TICKET_GROUP(t) ((t) & 0xFF)
+
+struct S3MMixPool {
+    struct S3MPlayerContext* ctx;
+    int threads; /* Including the rendering thread */
+    S3MThread workers[S3M_MIX_POOL_MAX_THREADS - 1];
+    float* group_buffers; /* S3M_MIX_POOL_FRAMES stereo frames per group after the first */
+    int mixed[S3M_MIX_POOL_MAX_THREADS]; /* Groups that mixed an audible voice this job */
+
+    /* The job, set by the rendering thread before it moves ticket on */
+    float* out; /* The first group mixes here */
+    int frames;
+    unsigned long audible;
+
+    unsigned int ticket;
+    unsigned int finished; /* Groups of the current job mixed */
+    unsigned int rendering; /* Keeps the workers from sleeping */
+    unsigned int running;
+};
+
+/* Mixes group (of groups) of the active voices and moves the muted ones on */
+static void s3m_mix_pool_mix_group(struct S3MMixPool* pool, int group, int groups)
+{
+    struct S3MPlayerContext* ctx = pool->ctx;
+    int count = ctx->active_voice_count;
+    int last = (group + 1) * count / groups;
+    float* out = group
+        ? &pool->group_buffers[(group - 1) * S3M_MIX_POOL_FRAMES * 2]
+        : pool->out;
+    int i, mixed = 0;
+
+    for (i = group * count / groups; i < last; i++) {
+        int c = ctx->active_voices[i];
+        struct S3MSampleStream* ss = &ctx->sample_stream[c];
+
+        if ((pool->audible & (1UL << c)) && ss->playing) {
+            /* The output was cleared by the caller */
+            if (!mixed && group)
+                memset(out, 0, sizeof(float) * pool->frames * 2);
+            mixed = 1;
+            s3m_accumulate_sample_stream(out, pool->frames, ss, ctx);
+        } else {
+            s3m_skip_sample_stream(ss, pool->frames);
+        }
+    }
+    pool->mixed[group] = mixed;
+}
+
+/* Takes groups of the current job until there are none left */
+static void s3m_mix_pool_take_groups(struct S3MMixPool* pool)
+{
+    for (;;) {
+        unsigned int ticket = s3m_load_acquire(&pool->ticket);
+
+        if (TICKET_GROUP(ticket) >= TICKET_GROUPS(ticket))
+            return;
+        if (s3m_compare_exchange(&pool->ticket, ticket, ticket + 1)) {
+            s3m_mix_pool_mix_group(pool, TICKET_GROUP(ticket), TICKET_GROUPS(ticket));
+            s3m_fetch_add(&pool->finished, 1);
+        }
+    }
+}
+
+static S3M_THREAD_FUNC(s3m_mix_pool_worker)
+{
+    struct S3MMixPool* pool = (struct S3MMixPool*)arg;
+    unsigned int seen = 0;
+
+    for (;;) {
+        unsigned int ticket;
+        int spins = 0;
+
+        while (TICKET_GENERATION(ticket = s3m_load_acquire(&pool->ticket)) == seen
+            && s3m_load_acquire(&pool->running)) {
+            if (spins < SPIN_LIMIT) {
+                spins++;
+                s3m_thread_yield();
+            } else if (s3m_load_acquire(&pool->rendering)) {
+                s3m_thread_yield();
+            } else {
+                s3m_sleep_ms(1);
+            }
+        }
+        seen = TICKET_GENERATION(ticket);
+        if (!s3m_load_acquire(&pool->running))
+            break;
+        s3m_mix_pool_take_groups(pool);
+    }
+    return 0;
+}
+
+struct S3MMixPool* s3m_mix_pool_create(struct S3MPlayerContext* ctx, int threads)
+{
+    struct S3MMixPool* pool = calloc(1, sizeof(struct S3MMixPool));
+
+    if (pool == NULL)
+        return NULL;
+    if (threads > S3M_MIX_POOL_MAX_THREADS)
+        threads = S3M_MIX_POOL_MAX_THREADS;
+    pool->group_buffers = malloc(sizeof(float) * S3M_MIX_POOL_FRAMES * 2 * (threads - 1));
+    if (pool->group_buffers == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pool->ctx = ctx;
+    pool->running = 1;
+    pool->threads = 1;
+    while (pool->threads < threads) {
+        if (!s3m_thread_start(&pool->workers[pool->threads - 1], s3m_mix_pool_worker, pool)) {
+            s3m_mix_pool_destroy(pool);
+            return NULL;
+        }
+        pool->threads++;
+    }
+    return pool;
+}
+
+void s3m_mix_pool_destroy(struct S3MMixPool* pool)
+{
+    unsigned int generation = TICKET_GENERATION(s3m_load_acquire(&pool->ticket));
+    int i;
+
+    /* A new generation with no groups wakes the workers to see running */
+    s3m_store_release(&pool->running, 0);
+    s3m_store_release(&pool->ticket, ((generation + 1) & 0xFFFF) << 16);
+    for (i = 0; i < pool->threads - 1; i++)
+        s3m_thread_join(pool->workers[i]);
+    free(pool->group_buffers);
+    free(pool);
+}
+
+void s3m_mix_pool_set_rendering(struct S3MMixPool* pool, int rendering)
+{
+    s3m_store_release(&pool->rendering, rendering != 0);
+}
+
+void s3m_mix_pool_render(struct S3MMixPool* pool, float* buffer, int frames, unsigned long audible)
+{
+    int groups = pool->ctx->active_voice_count / S3M_MIX_POOL_MIN_GROUP;
+
+    if (groups > pool->threads)
+        groups = pool->threads;
+    while (frames) {
+        int chunk = (frames < S3M_MIX_POOL_FRAMES) ? frames : S3M_MIX_POOL_FRAMES;
+        unsigned int generation = TICKET_GENERATION(s3m_load_acquire(&pool->ticket));
+        int g, i;
+
+        /* Every group of the last job is finished, so no worker is
+         * looking at these until ticket moves on. */
+        pool->out = buffer;
+        pool->frames = chunk;
+        pool->audible = audible;
+        s3m_store_release(&pool->finished, 0);
+        s3m_store_release(&pool->ticket, ((generation + 1) & 0xFFFF) << 16 | (unsigned int)groups << 8);
+
+        s3m_mix_pool_take_groups(pool);
+        while (s3m_load_acquire(&pool->finished) != (unsigned int)groups)
+            s3m_thread_yield();
+
+        for (g = 1; g < groups; g++) {
+            const float* group = &pool->group_buffers[(g - 1) * S3M_MIX_POOL_FRAMES * 2];
+            if (!pool->mixed[g])
+                continue;
+            for (i = 0; i < chunk * 2; i++)
+                buffer[i] += group[i];
+        }
+        buffer += chunk * 2;
+        frames -= chunk;
+    }
+}
+
+/*
+ * Mixes this player's voices on threads threads, counting the one calling
+ * s3m_render_audio; 1 or less goes back to mixing on the calling thread.
+ * Not to be called while rendering. Returns 0 if the threads can't start,
+ * leaving mixing serial.
+ */
+int s3m_set_mix_threads(struct S3MPlayerContext* ctx, int threads)
+{
+    if (ctx->mix_pool) {
+        s3m_mix_pool_destroy(ctx->mix_pool);
+        ctx->mix_pool = NULL;
+    }
+    if (threads <= 1)
+        return 1;
+    ctx->mix_pool = s3m_mix_pool_create(ctx, threads);
+    return ctx->mix_pool != NULL;
+}
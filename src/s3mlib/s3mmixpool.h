@@ -0,0 +1,35 @@
+#ifndef _S3MMIXPOOL_H_
+#define _S3MMIXPOOL_H_
+
+#include "s3m.h"
+
+/*
+ * Worker threads that mix one player's voices in parallel between ticks;
+ * the sequencer still runs on the rendering thread. The active voices are
+ * split into one contiguous group per thread, or fewer if there aren't
+ * S3M_MIX_POOL_MIN_GROUP voices for each. The first group is mixed
+ * straight into the output and each other group into a buffer of its own,
+ * and those are added to the output in group order. The result depends
+ * only on the number of groups, so it is the same on every run, but it
+ * can differ from the serial mixer's in the last bit of a sample.
+ */
+
+#define S3M_MIX_POOL_FRAMES 1024 /* Frames mixed per hand-off to the workers */
+#define S3M_MIX_POOL_MAX_THREADS 32 /* One per channel at most */
+#define S3M_MIX_POOL_MIN_GROUP 4 /* Fewest voices worth handing to another thread */
+
+/* threads counts the rendering thread; returns NULL if they can't start */
+extern struct S3MMixPool* s3m_mix_pool_create(struct S3MPlayerContext*, int threads);
+extern void s3m_mix_pool_destroy(struct S3MMixPool*);
+
+/*
+ * Adds the active audible voices into buffer and moves the others on.
+ * Needs at least 2 * S3M_MIX_POOL_MIN_GROUP active voices; mix fewer
+ * serially.
+ */
+extern void s3m_mix_pool_render(struct S3MMixPool*, float* buffer, int frames, unsigned long audible);
+
+/* Nonzero while the player renders, so the workers don't go to sleep */
+extern void s3m_mix_pool_set_rendering(struct S3MMixPool*, int rendering);
+
+#endif
@@ -0,0 +1,56 @@
+#include "s3mpcm.h"
+#include "s3matomic.h"
+#include <stdlib.h>
+#include <string.h>
+
+int s3m_pcm_ring_init(struct S3MPcmRing* ring, unsigned int min_frames)
+{
+    memset(ring, 0, sizeof(struct S3MPcmRing));
+    for (ring->capacity = 1; ring->capacity < min_frames; ring->capacity *= 2)
+        ;
+    ring->frames = calloc(ring->capacity, sizeof(float) * 2);
+    return ring->frames != NULL;
+}
+
+void s3m_pcm_ring_free(struct S3MPcmRing* ring)
+{
+    free(ring->frames);
+    ring->frames = NULL;
+}
+
+unsigned int s3m_pcm_ring_fill(struct S3MPcmRing* ring)
+{
+    return s3m_load_acquire(&ring->head) - s3m_load_acquire(&ring->tail);
+}
+
+float* s3m_pcm_ring_reserve(struct S3MPcmRing* ring, unsigned int* frames)
+{
+    unsigned int free_frames = ring->capacity - (ring->head - s3m_load_acquire(&ring->tail));
+    unsigned int offset = ring->head & (ring->capacity - 1);
+
+    *frames = (free_frames < ring->capacity - offset) ? free_frames : ring->capacity - offset;
+    return &ring->frames[offset * 2];
+}
+
+void s3m_pcm_ring_commit(struct S3MPcmRing* ring, unsigned int frames)
+{
+    s3m_store_release(&ring->head, ring->head + frames);
+}
+
+unsigned int s3m_pcm_ring_read(struct S3MPcmRing* ring, float* out, unsigned int frames)
+{
+    unsigned int available = s3m_load_acquire(&ring->head) - ring->tail;
+    unsigned int count = (available < frames) ? available : frames;
+    unsigned int offset = ring->tail & (ring->capacity - 1);
+    unsigned int first = (count < ring->capacity - offset) ? count : ring->capacity - offset;
+
+    memcpy(out, &ring->frames[offset * 2], sizeof(float) * 2 * first);
+    memcpy(&out[first * 2], ring->frames, sizeof(float) * 2 * (count - first));
+    s3m_store_release(&ring->tail, ring->tail + count);
+
+    if (count < frames) {
+        memset(&out[count * 2], 0, sizeof(float) * 2 * (frames - count));
+        ring->underruns++;
+    }
+    return count;
+}
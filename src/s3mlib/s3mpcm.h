@@ -0,0 +1,39 @@
+#ifndef _S3MPCM_H_
+#define _S3MPCM_H_
+
+/*
+ * Interleaved stereo float frames passed from one producer thread to one
+ * consumer thread, typically a render thread working ahead of an audio
+ * callback. Neither side blocks or takes a lock.
+ */
+struct S3MPcmRing {
+    float* frames;
+    unsigned int capacity; /* In frames, a power of two */
+    unsigned int head; /* Frames ever written, only the producer stores it */
+    unsigned int tail; /* Frames ever read, only the consumer stores it */
+    unsigned int underruns; /* Reads the ring couldn't fill, consumer only */
+};
+
+/* Allocates room for at least min_frames; returns 0 if out of memory */
+extern int s3m_pcm_ring_init(struct S3MPcmRing*, unsigned int min_frames);
+extern void s3m_pcm_ring_free(struct S3MPcmRing*);
+
+/* Frames written and not yet read; either side may ask */
+extern unsigned int s3m_pcm_ring_fill(struct S3MPcmRing*);
+
+/*
+ * Producer: the contiguous free space to render into and its size in
+ * frames (which may be less than all the free space when it wraps), then
+ * s3m_pcm_ring_commit with the frames actually written.
+ */
+extern float* s3m_pcm_ring_reserve(struct S3MPcmRing*, unsigned int* frames);
+extern void s3m_pcm_ring_commit(struct S3MPcmRing*, unsigned int frames);
+
+/*
+ * Consumer: copies up to frames into out and fills the rest with
+ * silence, counting an underrun when it comes up short. Returns the
+ * frames that came from the ring.
+ */
+extern unsigned int s3m_pcm_ring_read(struct S3MPcmRing*, float* out, unsigned int frames);
+
+#endif
@@ -0,0 +1,287 @@
+#include "s3m.h"
+#include <stdlib.h>
+#include <string.h>
+
+/* Every order played once at most; a scan that gets further is stuck */
+#define MAX_SCAN_ROWS (256 * 64)
+#define NOT_PLAYED ((unsigned long)-1)
+
+/* Plays one tick without mixing and returns its length in frames */
+static int s3m_skip_tick(struct S3MPlayerContext* ctx)
+{
+    int i;
+
+    s3m_process_tick(ctx);
+    s3m_update_voices(ctx);
+    for (i = 0; i < ctx->active_voice_count; i++)
+        s3m_skip_sample_stream(&ctx->sample_stream[ctx->active_voices[i]], ctx->samples_per_tick);
+    return ctx->samples_per_tick;
+}
+
+/*
+ * Moves playback on by frames exactly as s3m_render_audio would, but
+ * without mixing. Rows skipped over aren't published or counted.
+ */
+void s3m_skip_audio(struct S3MPlayerContext* ctx, unsigned long frames)
+{
+    struct S3MEventRing* events = ctx->events;
+    int stats_enabled = ctx->stats_enabled;
+
+    ctx->events = NULL;
+    ctx->stats_enabled = 0;
+    while (frames) {
+        int n, i;
+
+        if (ctx->samples_until_next_tick == 0) {
+            s3m_process_tick(ctx);
+            s3m_update_voices(ctx);
+            ctx->samples_until_next_tick = ctx->samples_per_tick;
+        }
+        n = (frames < (unsigned long)ctx->samples_until_next_tick)
+            ? (int)frames
+            : ctx->samples_until_next_tick;
+        frames -= n;
+        ctx->samples_until_next_tick -= n;
+        for (i = 0; i < ctx->active_voice_count; i++)
+            s3m_skip_sample_stream(&ctx->sample_stream[ctx->active_voices[i]], n);
+    }
+    ctx->events = events;
+    ctx->stats_enabled = stats_enabled;
+}
+
+static int s3m_index_add_row(struct S3MSeekIndex* index, int* capacity, const struct S3MPlayerContext* ctx, unsigned long frame)
+{
+    struct S3MRowTime* row;
+
+    if (index->row_count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 256;
+        struct S3MRowTime* rows = realloc(index->rows, sizeof(struct S3MRowTime) * grown);
+        if (rows == NULL)
+            return 0;
+        index->rows = rows;
+        *capacity = grown;
+    }
+    row = &index->rows[index->row_count++];
+    row->frame = frame;
+    row->order = ctx->current_order;
+    row->row = ctx->current_row;
+    return 1;
+}
+
+/* Only the first index->channels channels and voices are ever played */
+static int s3m_index_add_snapshot(struct S3MSeekIndex* index, int* capacity, const struct S3MPlayerContext* ctx, unsigned long frame)
+{
+    struct S3MSnapshot* snapshot;
+
+    if (index->snapshot_count == *capacity) {
+        int grown = *capacity ? *capacity * 2 : 32;
+        struct S3MSnapshot* snapshots = realloc(index->snapshots, sizeof(struct S3MSnapshot) * grown);
+        struct S3MChannel* channels;
+        struct S3MSampleStream* voices;
+
+        if (snapshots == NULL)
+            return 0;
+        index->snapshots = snapshots;
+        channels = realloc(index->channel_state, sizeof(struct S3MChannel) * index->channels * grown);
+        if (channels == NULL)
+            return 0;
+        index->channel_state = channels;
+        voices = realloc(index->voice_state, sizeof(struct S3MSampleStream) * index->channels * grown);
+        if (voices == NULL)
+            return 0;
+        index->voice_state = voices;
+        *capacity = grown;
+    }
+
+    snapshot = &index->snapshots[index->snapshot_count];
+    snapshot->frame = frame;
+    snapshot->order = ctx->current_order;
+    snapshot->row = ctx->current_row;
+    snapshot->tick_counter = ctx->tick_counter;
+    snapshot->tempo = ctx->song_tempo;
+    snapshot->speed = ctx->song_speed;
+    snapshot->samples_per_tick = ctx->samples_per_tick;
+    snapshot->effect_channels = ctx->effect_channels;
+    memcpy(&index->channel_state[index->snapshot_count * index->channels], ctx->channel,
+        sizeof(struct S3MChannel) * index->channels);
+    memcpy(&index->voice_state[index->snapshot_count * index->channels], ctx->sample_stream,
+        sizeof(struct S3MSampleStream) * index->channels);
+    index->snapshot_count++;
+    return 1;
+}
+
+/*
+ * Scans the song from the start until it loops, snapshotting the player
+ * every rows_per_snapshot rows (S3M_SNAPSHOT_ROWS if 0). Call it before
+ * playback starts: it runs the context itself and leaves it back at the
+ * start of the song. Returns 0 if out of memory.
+ */
+int s3m_seek_index_build(struct S3MPlayerContext* ctx, struct S3MSeekIndex* index, int rows_per_snapshot)
+{
+    struct S3MEventRing* events = ctx->events;
+    int stats_enabled = ctx->stats_enabled;
+    int row_capacity = 0, snapshot_capacity = 0, status;
+    unsigned long frame = 0;
+
+    memset(index, 0, sizeof(struct S3MSeekIndex));
+    index->sample_rate = ctx->sample_rate;
+    index->channels = ctx->num_channels;
+    if (rows_per_snapshot <= 0)
+        rows_per_snapshot = S3M_SNAPSHOT_ROWS;
+
+    /* The first snapshot is the untouched player, where seeks to 0 go */
+    if (!s3m_index_add_snapshot(index, &snapshot_capacity, ctx, 0)) {
+        s3m_seek_index_free(index);
+        return 0;
+    }
+
+    ctx->events = NULL;
+    ctx->stats_enabled = 0;
+    status = 1;
+    /* The order wraps on the last row's first tick; like s3m_render_audio,
+     * the song ends when that row's remaining ticks have played */
+    while (status && !(ctx->loop_count > 0 && ctx->tick_counter == 0) && index->row_count < MAX_SCAN_ROWS) {
+        /* Rows are processed on ticks that start with the counter at 0 */
+        if (ctx->tick_counter == 0) {
+            if (index->row_count % rows_per_snapshot == 0)
+                status = s3m_index_add_snapshot(index, &snapshot_capacity, ctx, frame);
+            if (status)
+                status = s3m_index_add_row(index, &row_capacity, ctx, frame);
+        }
+        frame += s3m_skip_tick(ctx);
+    }
+    index->length = frame;
+
+    s3m_seek(ctx, index, 0);
+    ctx->events = events;
+    ctx->stats_enabled = stats_enabled;
+    if (!status)
+        s3m_seek_index_free(index);
+    return status;
+}
+
+void s3m_seek_index_free(struct S3MSeekIndex* index)
+{
+    free(index->rows);
+    free(index->snapshots);
+    free(index->channel_state);
+    free(index->voice_state);
+    memset(index, 0, sizeof(struct S3MSeekIndex));
+}
+
+/* The row playing at frame, or NULL if the index has no rows */
+const struct S3MRowTime* s3m_seek_index_row(const struct S3MSeekIndex* index, unsigned long frame)
+{
+    int low = 0, high = index->row_count - 1;
+
+    if (index->row_count == 0)
+        return NULL;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (index->rows[mid].frame <= frame)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return &index->rows[low];
+}
+
+static void s3m_snapshot_restore(struct S3MPlayerContext* ctx, const struct S3MSeekIndex* index, int i)
+{
+    const struct S3MSnapshot* snapshot = &index->snapshots[i];
+
+    ctx->current_order = snapshot->order;
+    ctx->current_pattern = ctx->pattern_order[snapshot->order];
+    ctx->current_row = snapshot->row;
+    ctx->tick_counter = snapshot->tick_counter;
+    ctx->song_tempo = snapshot->tempo;
+    ctx->song_speed = snapshot->speed;
+    ctx->samples_per_tick = snapshot->samples_per_tick;
+    ctx->samples_until_next_tick = 0;
+    ctx->effect_channels = snapshot->effect_channels;
+    ctx->loop_count = 0;
+    ctx->song_ended = 0;
+    ctx->active_voice_count = 0;
+    memcpy(ctx->channel, &index->channel_state[i * index->channels],
+        sizeof(struct S3MChannel) * index->channels);
+    memcpy(ctx->sample_stream, &index->voice_state[i * index->channels],
+        sizeof(struct S3MSampleStream) * index->channels);
+}
+
+/*
+ * Puts playback at frame (from the start of the song) by restoring the
+ * last snapshot before it and skipping the rest. The render thread must
+ * call this; other threads send S3M_COMMAND_SEEK.
+ */
+void s3m_seek(struct S3MPlayerContext* ctx, const struct S3MSeekIndex* index, unsigned long frame)
+{
+    int low = 0, high = index->snapshot_count - 1;
+
+    if (index->snapshot_count == 0)
+        return;
+    while (low < high) {
+        int mid = (low + high + 1) / 2;
+        if (index->snapshots[mid].frame <= frame)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    s3m_snapshot_restore(ctx, index, low);
+    s3m_skip_audio(ctx, frame - index->snapshots[low].frame);
+}
+
+/*
+ * Steps the sequencer alone, with no voices or mixing, until playback
+ * comes back to a row it has already played, and reports how long that
+ * took and where it went back to. Call it before playback starts; the
+ * context is left at the start of the song. Returns 0 if out of memory.
+ */
+int s3m_simulate(struct S3MPlayerContext* ctx, struct S3MSongInfo* info)
+{
+    struct S3MEventRing* events = ctx->events;
+    int stats_enabled = ctx->stats_enabled;
+    struct S3MSeekIndex start;
+    unsigned long* row_frame;
+    unsigned long frame = 0;
+    int capacity = 0, i;
+
+    memset(info, 0, sizeof(struct S3MSongInfo));
+    memset(&start, 0, sizeof(struct S3MSeekIndex));
+    start.channels = ctx->num_channels;
+    row_frame = malloc(sizeof(unsigned long) * MAX_SCAN_ROWS);
+    if (row_frame == NULL || !s3m_index_add_snapshot(&start, &capacity, ctx, 0)) {
+        free(row_frame);
+        s3m_seek_index_free(&start);
+        return 0;
+    }
+    for (i = 0; i < MAX_SCAN_ROWS; i++)
+        row_frame[i] = NOT_PLAYED;
+
+    ctx->events = NULL;
+    ctx->stats_enabled = 0;
+    while (ctx->current_order < MAX_SCAN_ROWS / 64) {
+        if (ctx->tick_counter == 0) {
+            unsigned long* played = &row_frame[ctx->current_order * 64 + ctx->current_row];
+            if (*played != NOT_PLAYED) {
+                info->loops = 1;
+                info->loop_order = ctx->current_order;
+                info->loop_row = ctx->current_row;
+                info->loop_start = *played;
+                break;
+            }
+            *played = frame;
+            info->rows++;
+        }
+        s3m_process_tick(ctx);
+        info->ticks++;
+        frame += ctx->samples_per_tick;
+    }
+    info->length = frame;
+
+    s3m_snapshot_restore(ctx, &start, 0);
+    ctx->events = events;
+    ctx->stats_enabled = stats_enabled;
+    s3m_seek_index_free(&start);
+    free(row_frame);
+    return 1;
+}
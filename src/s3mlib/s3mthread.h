@@ -0,0 +1,32 @@
+#ifndef _S3MTHREAD_H_
+#define _S3MTHREAD_H_
+
+/*
+ * The little threading the tools need, on POSIX threads or Win32. Every
+ * player context is independent, so one thread may run each player.
+ */
+#ifdef _WIN32
+#include <windows.h>
+typedef HANDLE S3MThread;
+typedef LPTHREAD_START_ROUTINE S3MThreadFunc;
+#define S3M_THREAD_FUNC(name) DWORD WINAPI name(LPVOID arg)
+#else
+#include <pthread.h>
+typedef pthread_t S3MThread;
+typedef void* (*S3MThreadFunc)(void*);
+#define S3M_THREAD_FUNC(name) void* name(void* arg)
+#endif
+
+/* Returns 0 if the thread couldn't be started */
+extern int s3m_thread_start(S3MThread*, S3MThreadFunc, void* arg);
+extern void s3m_thread_join(S3MThread);
+extern void s3m_sleep_ms(unsigned int ms);
+/* Lets another runnable thread have the processor */
+extern void s3m_thread_yield(void);
+
+/* Processors currently online, at least 1 */
+extern int s3m_cpu_count(void);
+/* Monotonic wall clock time in seconds from an arbitrary start */
+extern double s3m_wall_seconds(void);
+
+#endif
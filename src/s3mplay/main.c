@@ -1,11 +1,100 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
 #include "portaudio.h"
 #include "s3m.h"
+#include "s3matomic.h"
+#include "s3mevent.h"
+#include "s3mpcm.h"
+#include "s3mthread.h"
 #include "mod.h"
 #include <ctype.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #define SAMPLE_RATE 48000
+#define DEFAULT_BUFFER_FRAMES 1024
+#define DISPLAY_INTERVAL_MS 10
+
+/* Rows and orders come from the audio callback through the event ring
+ * and are printed by the display thread, keeping stdio off the audio
+ * thread. */
+static struct S3MEventRing display_events;
+static unsigned int display_running;
+
+/* With render ahead on, a render thread keeps the ring topped up and
+ * the audio callback only copies out of it. */
+static struct S3MPcmRing render_ring;
+static unsigned int render_ahead_frames; /* 0 renders in the callback */
+static unsigned int render_interval_ms;
+static unsigned int render_running;
+
+static unsigned long xruns; /* Callbacks PortAudio reported as late */
+
+static void print_event(const struct S3MEvent* event)
+{
+    char buffer[16];
+    const char* prefix = "";
+    int i;
+
+    if (event->type == S3M_EVENT_ORDER) {
+        printf("Current Pattern: %d\n", event->pattern);
+        return;
+    }
+    for (i = 0; i < 8 && i < event->channels; i++) {
+        s3m_format_pattern_entry(buffer, &event->cells[i]);
+        printf("%s%s", prefix, buffer);
+        prefix = " | ";
+    }
+    printf("\n");
+}
+
+static void display_drain(void)
+{
+    struct S3MEvent event;
+
+    while (s3m_event_pop(&display_events, &event))
+        print_event(&event);
+    fflush(stdout);
+}
+
+static S3M_THREAD_FUNC(display_thread)
+{
+    (void)arg;
+    while (s3m_load_acquire(&display_running)) {
+        display_drain();
+        s3m_sleep_ms(DISPLAY_INTERVAL_MS);
+    }
+    display_drain();
+    return 0;
+}
+
+/* Renders until the ring holds render_ahead_frames */
+static void render_ahead(struct S3MPlayerContext* player)
+{
+    unsigned int fill = s3m_pcm_ring_fill(&render_ring);
+
+    while (fill < render_ahead_frames) {
+        unsigned int frames;
+        float* frame_data = s3m_pcm_ring_reserve(&render_ring, &frames);
+
+        if (frames > render_ahead_frames - fill)
+            frames = render_ahead_frames - fill;
+        s3m_render_audio(frame_data, frames, player);
+        s3m_pcm_ring_commit(&render_ring, frames);
+        fill += frames;
+    }
+}
+
+static S3M_THREAD_FUNC(render_thread)
+{
+    while (s3m_load_acquire(&render_running)) {
+        render_ahead((struct S3MPlayerContext*)arg);
+        s3m_sleep_ms(render_interval_ms);
+    }
+    return 0;
+}
 
 int player_callback(
     const void* inputBuffer, void* outputBuffer,
@@ -16,16 +105,83 @@ int player_callback(
 
     /* Prevent unused variable warnings. */
     (void)timeInfo;
-    (void)statusFlags;
     (void)inputBuffer;
-    (void)userData;
 
-    /* Call scream tracker 3 audio stream generator */
-    s3m_render_audio(outputBuffer, framesPerBuffer, (struct S3MPlayerContext*)userData);
+    if (statusFlags & paOutputUnderflow)
+        xruns++;
+
+    if (render_ahead_frames)
+        s3m_pcm_ring_read(&render_ring, outputBuffer, framesPerBuffer);
+    else
+        s3m_render_audio(outputBuffer, framesPerBuffer, (struct S3MPlayerContext*)userData);
 
     return paContinue;
 }
 
+/*
+ * Handles a line typed while playing. Commands go through the player's
+ * queue and take effect at the next tick; the player's own state belongs
+ * to the audio thread, so what's muted or paused is tracked here too.
+ * Returns 0 when it's time to exit.
+ */
+static int send_command(struct S3MPlayerContext* player, const char* line)
+{
+    static unsigned long muted, solo;
+    static int paused;
+    int arg = atoi(&line[1]);
+    int channel = arg - 1; /* Channels are numbered from 1 on screen */
+    int sent = 1;
+
+    switch (line[0]) {
+    case '\n':
+    case '\0':
+        return 0;
+    case 'p':
+        if ((sent = s3m_send_command(player, S3M_COMMAND_PAUSE, 0, !paused)) != 0)
+            paused = !paused;
+        break;
+    case 'm':
+        if (channel < 0 || channel >= 32)
+            break;
+        if ((sent = s3m_send_command(player, S3M_COMMAND_MUTE, channel, !((muted >> channel) & 1))) != 0)
+            muted ^= 1UL << channel;
+        break;
+    case 's':
+        if (channel < 0 || channel >= 32)
+            break;
+        if ((sent = s3m_send_command(player, S3M_COMMAND_SOLO, channel, !((solo >> channel) & 1))) != 0)
+            solo ^= 1UL << channel;
+        break;
+    case 'j':
+        sent = s3m_send_command(player, S3M_COMMAND_JUMP, arg, 0);
+        break;
+    case 'v':
+        sent = s3m_send_command(player, S3M_COMMAND_GLOBAL_VOLUME, 0, arg);
+        break;
+    case 't':
+        sent = s3m_send_command(player, S3M_COMMAND_TEMPO, 0, arg);
+        break;
+    case 'g':
+        sent = s3m_send_command(player, S3M_COMMAND_SEEK, 0, (int)(atof(&line[1]) * 1000));
+        break;
+    default:
+        printf("Unknown command\n");
+        break;
+    }
+    if (!sent)
+        printf("Player busy, command dropped\n");
+    return 1;
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options] <file.s3m|file.mod>\n"
+        "  -a <ms>        Render this far ahead on a separate thread (default: off)\n"
+        "  -b <frames>    Frames per audio callback (default: %d)\n",
+        program, DEFAULT_BUFFER_FRAMES);
+}
+
 void strlower(char *s) {
     while(*s) {
         *s = tolower(*s);
@@ -41,18 +197,40 @@ int main(int argc, char* argv[])
     FILE *fp;
 
     struct S3MPlayerContext player;
+    struct S3MStats stats;
+    struct S3MSeekIndex seek_index;
+    S3MThread display, render;
     struct S3MFile s3m;
     struct Mod mod;
 
-    char* filename;
+    char* filename = NULL;
     char extension[16];
+    char line[64];
+    int ahead_ms = 0;
+    int buffer_frames = DEFAULT_BUFFER_FRAMES;
+    int i;
 
-    if (argc < 2) {
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            ahead_ms = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            buffer_frames = atoi(argv[++i]);
+        } else if (argv[i][0] == '-') {
+            usage(argv[0]);
+            return 1;
+        } else {
+            filename = argv[i];
+        }
+    }
+    if (ahead_ms < 0 || buffer_frames <= 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (filename == NULL) {
         fprintf(stderr, "Please enter a filename\n");
         return 1;
     }
 
-    filename = argv[1];
     /* snip the last four characters */
     strcpy(extension, &filename[strlen(filename) - 4]);
     strlower(extension);
@@ -62,7 +240,10 @@ int main(int argc, char* argv[])
             fprintf(stderr, "Errors loading S3M File\n");
             return 1;
         }
-        s3m_player_init(&player, &s3m, SAMPLE_RATE);
+        if (!s3m_player_init(&player, &s3m, SAMPLE_RATE)) {
+            fprintf(stderr, "Can't play S3M File\n");
+            return 1;
+        }
     }
     if (strncmp(extension, ".mod", 4) == 0) {
         fp = fopen(filename, "rb");
@@ -70,7 +251,45 @@ int main(int argc, char* argv[])
             fprintf(stderr, "Errors loading MOD File\n");
             return 1;
         }
-        mod_player_init(&player, &mod, SAMPLE_RATE);
+        if (!mod_player_init(&player, &mod, SAMPLE_RATE)) {
+            fprintf(stderr, "Can't play MOD File\n");
+            return 1;
+        }
+    }
+
+    /* Cheap enough to leave on; reported when playback stops */
+    s3m_enable_stats(&player, 1);
+
+    if (!s3m_seek_index_build(&player, &seek_index, S3M_SNAPSHOT_ROWS)) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    player.seek_index = &seek_index;
+
+    s3m_event_ring_init(&display_events);
+    player.events = &display_events;
+    display_running = 1;
+    if (!s3m_thread_start(&display, display_thread, NULL)) {
+        fprintf(stderr, "Can't start the display thread\n");
+        return 1;
+    }
+
+    if (ahead_ms) {
+        /* The ring has to hold at least one callback's worth */
+        render_ahead_frames = (unsigned int)ahead_ms * SAMPLE_RATE / 1000;
+        if (render_ahead_frames < (unsigned int)buffer_frames)
+            render_ahead_frames = buffer_frames;
+        render_interval_ms = (ahead_ms >= 8) ? ahead_ms / 4 : 1;
+        if (!s3m_pcm_ring_init(&render_ring, render_ahead_frames)) {
+            fprintf(stderr, "Out of memory\n");
+            return 1;
+        }
+        render_ahead(&player);
+        render_running = 1;
+        if (!s3m_thread_start(&render, render_thread, &player)) {
+            fprintf(stderr, "Can't start the render thread\n");
+            return 1;
+        }
     }
 
     err = Pa_Initialize();
@@ -96,7 +315,7 @@ int main(int argc, char* argv[])
         NULL,
         &output_params,
         SAMPLE_RATE,
-        1024,
+        buffer_frames,
         paClipOff,
         player_callback,
         &player);
@@ -108,13 +327,36 @@ int main(int argc, char* argv[])
     if (err != paNoError)
         goto error;
 
-    printf("Press enter to exit...\n");
-    getchar();
+    printf("Commands: p pause, m <channel> mute, s <channel> solo, j <order> jump,\n"
+        "g <seconds> seek, v <0-64> global volume, t <bpm> tempo. Press enter to exit...\n");
+    while (fgets(line, sizeof(line), stdin) && send_command(&player, line))
+        ;
 
     err = Pa_StopStream(stream);
     if (err != paNoError)
         goto error;
 
+    if (render_ahead_frames) {
+        s3m_store_release(&render_running, 0);
+        s3m_thread_join(render);
+    }
+    s3m_store_release(&display_running, 0);
+    s3m_thread_join(display);
+    if (display_events.dropped)
+        printf("Display fell behind, %u events dropped\n", display_events.dropped);
+
+    s3m_seek_index_free(&seek_index);
+
+    s3m_get_stats(&player, &stats);
+    printf("Worst render call: %.2f ms, worst tick: %.3f ms, callback buffer: %.2f ms\n",
+        stats.max_callback_ns / 1e6, stats.max_tick_ns / 1e6, buffer_frames * 1e3 / SAMPLE_RATE);
+    printf("Xruns: %lu", xruns);
+    if (render_ahead_frames) {
+        printf(", render ahead underruns: %u", render_ring.underruns);
+        s3m_pcm_ring_free(&render_ring);
+    }
+    printf("\n");
+
     err = Pa_CloseStream(stream);
     if (err != paNoError)
         goto error;
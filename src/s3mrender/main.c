@@ -0,0 +1,686 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200112L
+#endif
+#include "s3m.h"
+#include "s3matomic.h"
+#include "s3mthread.h"
+#include "mod.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#define DEFAULT_SAMPLE_RATE 48000
+#define RENDER_FRAMES 1024
+
+enum OutputFormat {
+    FORMAT_WAV,
+    FORMAT_RAW
+};
+
+enum OutputEncoding {
+    ENCODING_S16,
+    ENCODING_F32
+};
+
+struct RenderOptions {
+    const char** inputs;
+    int input_count;
+    const char* output; /* NULL or "-" for stdout */
+    const char* output_dir; /* Batch mode: NULL to write beside each input */
+    int jobs; /* Batch mode worker threads, 0 = one per CPU */
+    int mix_threads; /* Threads mixing each song's voices */
+    enum OutputFormat format;
+    enum OutputEncoding encoding;
+    int sample_rate;
+    double max_seconds; /* 0 = until song end */
+    double start_seconds;
+    enum S3MInterpolation interpolation;
+    int quiet;
+    int stats;
+    int length_only;
+};
+
+static void strlower(char* s)
+{
+    while (*s) {
+        *s = tolower(*s);
+        s++;
+    }
+}
+
+static void usage(const char* program)
+{
+    fprintf(stderr,
+        "Usage: %s [options] <file.s3m|file.mod>...\n"
+        "  -o <file>      Output file (default: stdout)\n"
+        "  -d <dir>       Batch mode: write <name>.wav or .raw here (default: beside the input)\n"
+        "  -j <jobs>      Batch mode: files rendered at once (default: one per CPU)\n"
+        "  -m <threads>   Mix each song's voices on this many threads (default: 1)\n"
+        "  -f wav|raw     Container format (default: wav)\n"
+        "  -e s16|f32     Sample encoding (default: s16)\n",
+        program);
+    fprintf(stderr,
+        "  -r <rate>      Sample rate in Hz (default: %d)\n"
+        "  -t <seconds>   Stop after this many seconds (default: song end)\n"
+        "  -p <seconds>   Start this far into the song\n"
+        "  -i <mode>      Interpolation: nearest, linear, cubic or sinc (default: nearest)\n"
+        "  -q             Don't print render statistics\n"
+        "  -s             Print player instrumentation counters\n"
+        "  -l             Print the song length and loop point instead of rendering\n",
+        DEFAULT_SAMPLE_RATE);
+}
+
+static int parse_options(struct RenderOptions* opts, int argc, char* argv[])
+{
+    int i;
+
+    opts->inputs = malloc(sizeof(const char*) * argc);
+    opts->input_count = 0;
+    opts->output = NULL;
+    opts->output_dir = NULL;
+    opts->jobs = 0;
+    opts->mix_threads = 1;
+    opts->format = FORMAT_WAV;
+    opts->encoding = ENCODING_S16;
+    opts->sample_rate = DEFAULT_SAMPLE_RATE;
+    opts->max_seconds = 0;
+    opts->start_seconds = 0;
+    opts->interpolation = S3M_INTERPOLATION_NEAREST;
+    opts->quiet = 0;
+    opts->stats = 0;
+    opts->length_only = 0;
+
+    for (i = 1; i < argc; i++) {
+        const char* arg = argv[i];
+        if (arg[0] != '-' || arg[1] == '\0') {
+            opts->inputs[opts->input_count++] = arg;
+            continue;
+        }
+        if (strcmp(arg, "-q") == 0) {
+            opts->quiet = 1;
+            continue;
+        }
+        if (strcmp(arg, "-s") == 0) {
+            opts->stats = 1;
+            continue;
+        }
+        if (strcmp(arg, "-l") == 0) {
+            opts->length_only = 1;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            fprintf(stderr, "Missing value for %s\n", arg);
+            return 0;
+        }
+        if (strcmp(arg, "-o") == 0) {
+            opts->output = argv[++i];
+        } else if (strcmp(arg, "-d") == 0) {
+            opts->output_dir = argv[++i];
+        } else if (strcmp(arg, "-j") == 0) {
+            opts->jobs = atoi(argv[++i]);
+            if (opts->jobs <= 0) {
+                fprintf(stderr, "Invalid job count: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(arg, "-f") == 0) {
+            i++;
+            if (strcmp(argv[i], "wav") == 0)
+                opts->format = FORMAT_WAV;
+            else if (strcmp(argv[i], "raw") == 0)
+                opts->format = FORMAT_RAW;
+            else {
+                fprintf(stderr, "Unknown format: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(arg, "-e") == 0) {
+            i++;
+            if (strcmp(argv[i], "s16") == 0)
+                opts->encoding = ENCODING_S16;
+            else if (strcmp(argv[i], "f32") == 0)
+                opts->encoding = ENCODING_F32;
+            else {
+                fprintf(stderr, "Unknown encoding: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(arg, "-r") == 0) {
+            opts->sample_rate = atoi(argv[++i]);
+            if (opts->sample_rate <= 0) {
+                fprintf(stderr, "Invalid sample rate: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(arg, "-m") == 0) {
+            opts->mix_threads = atoi(argv[++i]);
+            if (opts->mix_threads <= 0) {
+                fprintf(stderr, "Invalid thread count: %s\n", argv[i]);
+                return 0;
+            }
+        } else if (strcmp(arg, "-t") == 0) {
+            opts->max_seconds = atof(argv[++i]);
+        } else if (strcmp(arg, "-p") == 0) {
+            opts->start_seconds = atof(argv[++i]);
+        } else if (strcmp(arg, "-i") == 0) {
+            i++;
+            if (strcmp(argv[i], "nearest") == 0)
+                opts->interpolation = S3M_INTERPOLATION_NEAREST;
+            else if (strcmp(argv[i], "linear") == 0)
+                opts->interpolation = S3M_INTERPOLATION_LINEAR;
+            else if (strcmp(argv[i], "cubic") == 0)
+                opts->interpolation = S3M_INTERPOLATION_CUBIC;
+            else if (strcmp(argv[i], "sinc") == 0)
+                opts->interpolation = S3M_INTERPOLATION_SINC;
+            else {
+                fprintf(stderr, "Unknown interpolation: %s\n", argv[i]);
+                return 0;
+            }
+        } else {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            return 0;
+        }
+    }
+
+    if (opts->input_count == 0) {
+        fprintf(stderr, "Please enter a filename\n");
+        return 0;
+    }
+    if (opts->output && (opts->input_count > 1 || opts->output_dir)) {
+        fprintf(stderr, "-o takes a single input; use -d for several\n");
+        return 0;
+    }
+    return 1;
+}
+
+static void write_le16(FILE* fp, int value)
+{
+    fputc(value & 0xFF, fp);
+    fputc((value >> 8) & 0xFF, fp);
+}
+
+static void write_le32(FILE* fp, unsigned long value)
+{
+    fputc(value & 0xFF, fp);
+    fputc((value >> 8) & 0xFF, fp);
+    fputc((value >> 16) & 0xFF, fp);
+    fputc((value >> 24) & 0xFF, fp);
+}
+
+/* Sizes of 0xFFFFFFFF mark a stream of unknown length; they are patched
+ * afterwards when the output is seekable. */
+static void write_wav_header(FILE* fp, const struct RenderOptions* opts, unsigned long data_bytes)
+{
+    int bytes_per_sample = (opts->encoding == ENCODING_F32) ? 4 : 2;
+    int is_unknown = (data_bytes == 0xFFFFFFFFUL);
+
+    fwrite("RIFF", 1, 4, fp);
+    write_le32(fp, is_unknown ? 0xFFFFFFFFUL : 36 + data_bytes);
+    fwrite("WAVE", 1, 4, fp);
+    fwrite("fmt ", 1, 4, fp);
+    write_le32(fp, 16);
+    write_le16(fp, (opts->encoding == ENCODING_F32) ? 3 : 1); /* IEEE float : PCM */
+    write_le16(fp, 2);
+    write_le32(fp, opts->sample_rate);
+    write_le32(fp, (unsigned long)opts->sample_rate * 2 * bytes_per_sample);
+    write_le16(fp, 2 * bytes_per_sample);
+    write_le16(fp, bytes_per_sample * 8);
+    fwrite("data", 1, 4, fp);
+    write_le32(fp, data_bytes);
+}
+
+static void write_frames(FILE* fp, const float* buffer, int frames, enum OutputEncoding encoding)
+{
+    if (encoding == ENCODING_F32) {
+        fwrite(buffer, sizeof(float), frames * 2, fp);
+    } else {
+        unsigned char out[RENDER_FRAMES * 2 * 2];
+        int i;
+        for (i = 0; i < frames * 2; i++) {
+            float s = buffer[i] * 32767.0f;
+            int v = (s > 32767.0f) ? 32767 : (s < -32768.0f) ? -32768 : (int)s;
+            out[i * 2] = v & 0xFF;
+            out[i * 2 + 1] = (v >> 8) & 0xFF;
+        }
+        fwrite(out, 2, frames * 2, fp);
+    }
+}
+
+static void print_song_length(struct S3MPlayerContext* player)
+{
+    struct S3MSongInfo info;
+
+    if (!s3m_simulate(player, &info)) {
+        fprintf(stderr, "Out of memory\n");
+        return;
+    }
+    printf("Length: %lu frames (%.3f s), %d rows\n",
+        info.length, (double)info.length / player->sample_rate, info.rows);
+    if (info.loops)
+        printf("Loops to order %d row %d, first played at frame %lu (%.3f s)\n",
+            info.loop_order, info.loop_row, info.loop_start, (double)info.loop_start / player->sample_rate);
+    else
+        printf("No loop found\n");
+}
+
+static void print_stats(const struct S3MStats* stats)
+{
+    fprintf(stderr, "Ticks: %lu, rows: %lu, render calls: %lu\n",
+        stats->ticks, stats->rows, stats->callbacks);
+    if (stats->chunks)
+        fprintf(stderr, "Voices mixed: %.2f average over %lu chunks, %lu voice frames\n",
+            (double)stats->voices_mixed / stats->chunks, stats->chunks, stats->voice_frames);
+    fprintf(stderr, "Tick processing: %.3f ms total, %.0f ns worst\n",
+        stats->tick_ns / 1e6, stats->max_tick_ns);
+    fprintf(stderr, "Mixing: %.3f ms total, worst render call %.0f ns\n",
+        stats->mix_ns / 1e6, stats->max_callback_ns);
+}
+
+/* A player and whichever song it plays; large, so kept off the stack */
+struct Song {
+    struct S3MPlayerContext player;
+    struct S3MFile s3m;
+    struct Mod mod;
+};
+
+static void song_free(struct Song* song)
+{
+    s3m_player_free(&song->player);
+    if (song->s3m.file_data)
+        s3m_unload(&song->s3m);
+    if (song->mod.file_data)
+        mod_unload(&song->mod);
+    free(song);
+}
+
+/*
+ * Allocates a song, loads input into it and initialises the player at the
+ * start offset. Returns NULL, having said why, if it can't.
+ */
+static struct Song* song_load(const struct RenderOptions* opts, const char* input)
+{
+    struct Song* song;
+    struct S3MPlayerContext* player;
+    char extension[16];
+    FILE* fp;
+
+    if (strlen(input) < 4) {
+        fprintf(stderr, "Unknown file type: %s\n", input);
+        return NULL;
+    }
+    strcpy(extension, &input[strlen(input) - 4]);
+    strlower(extension);
+
+    song = calloc(1, sizeof(struct Song));
+    if (song == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return NULL;
+    }
+    player = &song->player;
+
+    if (strncmp(extension, ".s3m", 4) == 0) {
+        if (!s3m_load(&song->s3m, input)) {
+            fprintf(stderr, "Errors loading S3M File: %s\n", input);
+            free(song);
+            return NULL;
+        }
+        if (!s3m_player_init(player, &song->s3m, opts->sample_rate)) {
+            fprintf(stderr, "Can't play S3M File: %s\n", input);
+            song_free(song);
+            return NULL;
+        }
+    } else if (strncmp(extension, ".mod", 4) == 0) {
+        fp = fopen(input, "rb");
+        if (!fp || !load_mod(&song->mod, fp)) {
+            fprintf(stderr, "Errors loading MOD File: %s\n", input);
+            if (fp)
+                fclose(fp);
+            free(song);
+            return NULL;
+        }
+        fclose(fp);
+        if (!mod_player_init(player, &song->mod, opts->sample_rate)) {
+            fprintf(stderr, "Can't play MOD File: %s\n", input);
+            song_free(song);
+            return NULL;
+        }
+    } else {
+        fprintf(stderr, "Unknown file type: %s\n", input);
+        free(song);
+        return NULL;
+    }
+
+    player->interpolation = opts->interpolation;
+    if (opts->start_seconds > 0) {
+        struct S3MSeekIndex index;
+        if (!s3m_seek_index_build(player, &index, S3M_SNAPSHOT_ROWS)) {
+            fprintf(stderr, "Out of memory\n");
+            song_free(song);
+            return NULL;
+        }
+        s3m_seek(player, &index, (unsigned long)(opts->start_seconds * opts->sample_rate));
+        s3m_seek_index_free(&index);
+    }
+    s3m_enable_stats(player, opts->stats);
+    return song;
+}
+
+struct RenderJob {
+    const char* input;
+    char* output; /* NULL for stdout */
+    long size; /* Input file bytes, standing in for the render time when ordering */
+    unsigned long frames;
+    double seconds; /* Wall clock time spent rendering */
+    struct S3MStats stats;
+    int failed;
+};
+
+/* Renders one file start to finish; any number can run at once. */
+static void render_file(const struct RenderOptions* opts, struct RenderJob* job)
+{
+    struct Song* song = song_load(opts, job->input);
+    struct S3MPlayerContext* player;
+    float buffer[RENDER_FRAMES * 2];
+    FILE* out;
+    unsigned long max_frames;
+    double start;
+
+    if (song == NULL) {
+        job->failed = 1;
+        return;
+    }
+    player = &song->player;
+    if (!s3m_set_mix_threads(player, opts->mix_threads)) {
+        fprintf(stderr, "Can't start the mixing threads\n");
+        job->failed = 1;
+        song_free(song);
+        return;
+    }
+
+    if (job->output == NULL) {
+        out = stdout;
+#ifdef _WIN32
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    } else {
+        out = fopen(job->output, "wb");
+    }
+    if (!out) {
+        fprintf(stderr, "Can't open output: %s\n", job->output ? job->output : "stdout");
+        job->failed = 1;
+        song_free(song);
+        return;
+    }
+
+    if (opts->format == FORMAT_WAV)
+        write_wav_header(out, opts, 0xFFFFFFFFUL);
+
+    max_frames = (opts->max_seconds > 0)
+        ? (unsigned long)(opts->max_seconds * opts->sample_rate)
+        : 0;
+
+    /* The player stops on the tick the song would loop on, so the end is sample accurate */
+    player->stop_at_song_end = 1;
+    start = s3m_wall_seconds();
+    job->frames = 0;
+    while (!player->song_ended) {
+        int frames = RENDER_FRAMES;
+
+        if (max_frames) {
+            if (job->frames >= max_frames)
+                break;
+            if (max_frames - job->frames < (unsigned long)frames)
+                frames = max_frames - job->frames;
+        }
+
+        frames = s3m_render_audio(buffer, frames, player);
+        write_frames(out, buffer, frames, opts->encoding);
+        job->frames += frames;
+    }
+    job->seconds = s3m_wall_seconds() - start;
+    s3m_get_stats(player, &job->stats);
+    song_free(song);
+
+    if (opts->format == FORMAT_WAV && job->output) {
+        unsigned long data_bytes = job->frames * 2
+            * ((opts->encoding == ENCODING_F32) ? 4 : 2);
+        rewind(out);
+        write_wav_header(out, opts, data_bytes);
+    }
+    fclose(out);
+}
+
+/*
+ * Workers take the next job from a shared counter, so one that finishes
+ * early just picks up more and a long song never holds up the others.
+ * Each worker has one file loaded at a time.
+ */
+struct RenderBatch {
+    const struct RenderOptions* opts;
+    struct RenderJob** order;
+    unsigned int count;
+    unsigned int next;
+};
+
+static S3M_THREAD_FUNC(batch_worker)
+{
+    struct RenderBatch* batch = (struct RenderBatch*)arg;
+    unsigned int i;
+
+    while ((i = s3m_fetch_add(&batch->next, 1)) < batch->count) {
+        render_file(batch->opts, batch->order[i]);
+    }
+    return 0;
+}
+
+/* Runs the batch on threads workers, the calling thread being one of them */
+static void batch_run(struct RenderBatch* batch, int threads)
+{
+    S3MThread* workers = malloc(sizeof(S3MThread) * threads);
+    int started = 0;
+
+    batch->next = 0;
+    if (workers) {
+        while (started < threads - 1 && s3m_thread_start(&workers[started], batch_worker, batch))
+            started++;
+    }
+    batch_worker(batch);
+    while (started > 0)
+        s3m_thread_join(workers[--started]);
+    free(workers);
+}
+
+static long file_size(const char* path)
+{
+    FILE* fp = fopen(path, "rb");
+    long size = 0;
+
+    if (fp) {
+        fseek(fp, 0, SEEK_END);
+        size = ftell(fp);
+        fclose(fp);
+    }
+    return size;
+}
+
+static int largest_first(const void* a, const void* b)
+{
+    const struct RenderJob* job_a = *(const struct RenderJob* const*)a;
+    const struct RenderJob* job_b = *(const struct RenderJob* const*)b;
+
+    if (job_a->size != job_b->size)
+        return (job_a->size < job_b->size) ? 1 : -1;
+    return (job_a < job_b) ? -1 : (job_a > job_b);
+}
+
+/* input's file name with a new extension, in dir or else beside input */
+static char* output_path(const char* input, const char* dir, enum OutputFormat format)
+{
+    const char* name = input;
+    const char* extension = (format == FORMAT_WAV) ? ".wav" : ".raw";
+    const char* p;
+    size_t dir_length, name_length;
+    char* path;
+
+    for (p = input; *p; p++)
+        if (*p == '/' || *p == '\\')
+            name = p + 1;
+    p = strrchr(name, '.');
+    name_length = p ? (size_t)(p - name) : strlen(name);
+    dir_length = dir ? strlen(dir) : (size_t)(name - input);
+
+    path = malloc(dir_length + 1 + name_length + strlen(extension) + 1);
+    if (path == NULL)
+        return NULL;
+    memcpy(path, dir ? dir : input, dir_length);
+    if (dir && dir_length && dir[dir_length - 1] != '/' && dir[dir_length - 1] != '\\')
+        path[dir_length++] = '/';
+    memcpy(&path[dir_length], name, name_length);
+    strcpy(&path[dir_length + name_length], extension);
+    return path;
+}
+
+/* Lengths are measured from the start of the song, whatever -p says */
+static void print_length(const struct RenderOptions* opts)
+{
+    struct RenderOptions from_start = *opts;
+    int i;
+
+    from_start.start_seconds = 0;
+    for (i = 0; i < opts->input_count; i++) {
+        struct Song* song = song_load(&from_start, opts->inputs[i]);
+        if (song == NULL)
+            continue;
+        if (opts->input_count > 1)
+            printf("%s\n", opts->inputs[i]);
+        print_song_length(&song->player);
+        song_free(song);
+    }
+}
+
+static void print_batch_report(const struct RenderOptions* opts, const struct RenderJob* jobs, int threads, double seconds)
+{
+    double audio_seconds = 0;
+    int i, failed = 0;
+
+    for (i = 0; i < opts->input_count; i++) {
+        const struct RenderJob* job = &jobs[i];
+        double job_audio = (double)job->frames / opts->sample_rate;
+
+        if (job->failed) {
+            failed++;
+            continue;
+        }
+        audio_seconds += job_audio;
+        if (opts->quiet)
+            continue;
+        fprintf(stderr, "%s: %.2f s of audio in %.3f s, %.1fx realtime\n",
+            job->output, job_audio, job->seconds,
+            (job->seconds > 0) ? job_audio / job->seconds : 0);
+        if (opts->stats)
+            print_stats(&job->stats);
+    }
+    if (!opts->quiet) {
+        fprintf(stderr, "Rendered %d files (%.2f s of audio) in %.3f s on %d threads\n",
+            opts->input_count - failed, audio_seconds, seconds, threads);
+        if (seconds > 0)
+            fprintf(stderr, "Realtime factor: %.1fx\n", audio_seconds / seconds);
+    }
+    if (failed)
+        fprintf(stderr, "%d files failed\n", failed);
+}
+
+int main(int argc, char* argv[])
+{
+    struct RenderOptions opts;
+    struct RenderBatch batch;
+    struct RenderJob* jobs;
+    int is_batch, threads, failed = 0;
+    double start;
+    int i;
+
+    if (!parse_options(&opts, argc, argv)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    if (opts.length_only) {
+        print_length(&opts);
+        free(opts.inputs);
+        return 0;
+    }
+
+    jobs = calloc(opts.input_count, sizeof(struct RenderJob));
+    batch.order = malloc(sizeof(struct RenderJob*) * opts.input_count);
+    if (jobs == NULL || batch.order == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    is_batch = (opts.input_count > 1 || opts.output_dir != NULL);
+    for (i = 0; i < opts.input_count; i++) {
+        jobs[i].input = opts.inputs[i];
+        if (is_batch) {
+            jobs[i].output = output_path(opts.inputs[i], opts.output_dir, opts.format);
+            if (jobs[i].output == NULL) {
+                fprintf(stderr, "Out of memory\n");
+                return 1;
+            }
+        } else if (opts.output && strcmp(opts.output, "-") != 0) {
+            jobs[i].output = (char*)opts.output;
+        }
+        batch.order[i] = &jobs[i];
+    }
+    /* Two workers writing one file at once would garble it */
+    for (i = 0; is_batch && i < opts.input_count; i++) {
+        int j;
+        for (j = 0; j < i; j++) {
+            if (strcmp(jobs[i].output, jobs[j].output) == 0) {
+                fprintf(stderr, "%s and %s would both be written to %s\n",
+                    jobs[j].input, jobs[i].input, jobs[i].output);
+                return 1;
+            }
+        }
+    }
+    batch.opts = &opts;
+    batch.count = opts.input_count;
+
+    threads = opts.jobs ? opts.jobs : s3m_cpu_count();
+    if (threads > opts.input_count)
+        threads = opts.input_count;
+
+    start = s3m_wall_seconds();
+    if (opts.input_count > threads) {
+        /* Start the biggest files first so no worker is left with a long
+         * song at the end. Size is only a rough guide to length, but it
+         * costs nothing, where simulating would load every file twice. */
+        for (i = 0; i < opts.input_count; i++)
+            jobs[i].size = file_size(jobs[i].input);
+        qsort(batch.order, batch.count, sizeof(struct RenderJob*), largest_first);
+    }
+    batch_run(&batch, threads);
+
+    if (is_batch) {
+        print_batch_report(&opts, jobs, threads, s3m_wall_seconds() - start);
+    } else if (!jobs[0].failed && !opts.quiet) {
+        double audio_seconds = (double)jobs[0].frames / opts.sample_rate;
+        fprintf(stderr, "Rendered %lu frames (%.2f s of audio) in %.3f s\n",
+            jobs[0].frames, audio_seconds, jobs[0].seconds);
+        if (jobs[0].seconds > 0)
+            fprintf(stderr, "Realtime factor: %.1fx, %.0f frames/sec\n",
+                audio_seconds / jobs[0].seconds, jobs[0].frames / jobs[0].seconds);
+    }
+    if (!is_batch && !jobs[0].failed && opts.stats)
+        print_stats(&jobs[0].stats);
+
+    for (i = 0; i < opts.input_count; i++) {
+        failed |= jobs[i].failed;
+        if (is_batch)
+            free(jobs[i].output);
+    }
+    free(jobs);
+    free(batch.order);
+    free(opts.inputs);
+    return failed;
+}
@@ -0,0 +1,184 @@
+#include "s3m.h"
+#include "mod.h"
+#include "synth.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Seeks into generated modules at frames that fall part way through a
+ * tick and checks that rendering from there is the tail of a full render,
+ * down to the last frame.
+ */
+
+#define SAMPLE_RATE 48000
+#define CHUNK_FRAMES 1024 /* Longer than a tick, so chunks straddle tick boundaries */
+
+/* The jump songs end with B01 and C16, so they loop back to order 1 row 16 */
+static const struct SynthModule test_songs[] = {
+    { "sparse-8ch", 0, 8, 2, 15, 0, 0, 0 },
+    { "effects-16ch", 0, 16, 2, 60, 1, 0, 0 },
+    { "mod-8ch", 1, 8, 2, 50, 1, 0, 0 },
+    { "jump-8ch", 0, 8, 3, 30, 1, 1, 16 },
+    { "jump-mod-8ch", 1, 8, 3, 50, 1, 1, 16 }
+};
+
+/* 0.5 s, 3.3 s and 7.77 s at 48 kHz; none is a whole number of ticks */
+static const unsigned long seek_frames[] = { 24000, 158400 + 137, 372960 + 311 };
+
+struct TestSong {
+    struct S3MPlayerContext player;
+    struct S3MFile s3m;
+    struct Mod mod;
+};
+
+static int song_load(struct TestSong* song, const char* path, int is_mod)
+{
+    memset(song, 0, sizeof(struct TestSong));
+    if (is_mod) {
+        FILE* fp = fopen(path, "rb");
+        int status = fp && load_mod(&song->mod, fp);
+        if (fp)
+            fclose(fp);
+        if (!status)
+            return 0;
+        if (!mod_player_init(&song->player, &song->mod, SAMPLE_RATE)) {
+            mod_unload(&song->mod);
+            return 0;
+        }
+    } else {
+        if (!s3m_load(&song->s3m, path))
+            return 0;
+        if (!s3m_player_init(&song->player, &song->s3m, SAMPLE_RATE)) {
+            s3m_unload(&song->s3m);
+            return 0;
+        }
+    }
+    song->player.stop_at_song_end = 1;
+    return 1;
+}
+
+static void song_unload(struct TestSong* song)
+{
+    s3m_player_free(&song->player);
+    if (song->s3m.file_data)
+        s3m_unload(&song->s3m);
+    if (song->mod.file_data)
+        mod_unload(&song->mod);
+}
+
+/* Renders until the song ends; returns the frame count, or -1 if out of memory */
+static long render_to_end(struct S3MPlayerContext* player, float** out)
+{
+    long frames = 0, capacity = 0;
+
+    *out = NULL;
+    while (!player->song_ended) {
+        if (frames + CHUNK_FRAMES > capacity) {
+            float* grown;
+            capacity = capacity ? capacity * 2 : SAMPLE_RATE * 16;
+            grown = realloc(*out, sizeof(float) * 2 * capacity);
+            if (grown == NULL) {
+                free(*out);
+                return -1;
+            }
+            *out = grown;
+        }
+        frames += s3m_render_audio(&(*out)[frames * 2], CHUNK_FRAMES, player);
+    }
+    return frames;
+}
+
+/*
+ * The seek index, s3m_simulate and a full render must agree on the length,
+ * and the song must loop back to where its last row sends it.
+ */
+static int check_song_info(const struct SynthModule* synth, struct TestSong* song, const char* path, long full_frames)
+{
+    struct S3MSeekIndex index;
+    struct S3MSongInfo info;
+    int failures = 0;
+
+    song_load(song, path, synth->is_mod);
+    if (!s3m_simulate(&song->player, &info) || !s3m_seek_index_build(&song->player, &index, S3M_SNAPSHOT_ROWS)) {
+        fprintf(stderr, "%s: out of memory\n", synth->name);
+        song_unload(song);
+        return 1;
+    }
+    if ((long)info.length != full_frames || index.length != info.length) {
+        fprintf(stderr, "%s: rendered %ld frames, simulated %lu, indexed %lu\n",
+            synth->name, full_frames, info.length, index.length);
+        failures++;
+    }
+    if (!info.loops || info.loop_order != synth->jump_order || info.loop_row != synth->jump_row) {
+        fprintf(stderr, "%s: loops %d to order %d row %d, expected order %d row %d\n",
+            synth->name, info.loops, info.loop_order, info.loop_row, synth->jump_order, synth->jump_row);
+        failures++;
+    }
+    s3m_seek_index_free(&index);
+    song_unload(song);
+    return failures;
+}
+
+static int test_song(const struct SynthModule* synth)
+{
+    struct TestSong* song = malloc(sizeof(struct TestSong));
+    struct S3MSeekIndex index;
+    char path[64];
+    float *full = NULL, *tail = NULL;
+    long full_frames, tail_frames;
+    int i, failures = 0;
+
+    sprintf(path, "seek_test-%s.%s", synth->name, synth->is_mod ? "mod" : "s3m");
+    if (song == NULL || !synth_write(synth, path) || !song_load(song, path, synth->is_mod)) {
+        fprintf(stderr, "%s: can't set up the song\n", synth->name);
+        free(song);
+        return 1;
+    }
+    full_frames = render_to_end(&song->player, &full);
+    song_unload(song);
+    if (full_frames >= 0)
+        failures += check_song_info(synth, song, path, full_frames);
+
+    for (i = 0; i < (int)(sizeof(seek_frames) / sizeof(seek_frames[0])); i++) {
+        unsigned long frame = seek_frames[i];
+
+        song_load(song, path, synth->is_mod);
+        if (full_frames < 0 || !s3m_seek_index_build(&song->player, &index, S3M_SNAPSHOT_ROWS)) {
+            fprintf(stderr, "%s: out of memory\n", synth->name);
+            song_unload(song);
+            failures++;
+            break;
+        }
+        s3m_seek(&song->player, &index, frame);
+        s3m_seek_index_free(&index);
+        tail_frames = render_to_end(&song->player, &tail);
+
+        if (tail_frames != full_frames - (long)frame) {
+            fprintf(stderr, "%s: seek to %lu rendered %ld frames, expected %ld\n",
+                synth->name, frame, tail_frames, full_frames - (long)frame);
+            failures++;
+        } else if (memcmp(tail, &full[frame * 2], sizeof(float) * 2 * tail_frames) != 0) {
+            fprintf(stderr, "%s: seek to %lu differs from the full render\n", synth->name, frame);
+            failures++;
+        }
+        free(tail);
+        song_unload(song);
+    }
+
+    free(full);
+    free(song);
+    remove(path);
+    return failures;
+}
+
+int main(void)
+{
+    int i, failures = 0;
+
+    for (i = 0; i < (int)(sizeof(test_songs) / sizeof(test_songs[0])); i++)
+        failures += test_song(&test_songs[i]);
+    if (failures)
+        fprintf(stderr, "%d seek checks failed\n", failures);
+    return failures != 0;
+}